@@ -0,0 +1,446 @@
+/*
+ * mybatch.c
+ *
+ * Batched datagram I/O.  A receive ring is a preallocated set of
+ * fixed-size buffers that recvmmsg() fills in one system call, so a
+ * burst of packets costs one syscall and no allocations.  One thread
+ * receives into it and another consumes from it without locking.  With
+ * SO_RXQ_OVFL set on the socket it also reports how many datagrams the
+ * kernel dropped for want of buffer space.  A send list
+ * is a fixed set of destinations that one buffer is sent to with a
+ * single sendmmsg().  A send queue holds encoded datagrams until they
+ * are sent to a send list a few at a time.  Destinations can be given
+ * their own socket, e.g. the one bound to the interface they are on.
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "mybatch.h"
+#include "mymetrics.h"
+
+#define RX_CTRL CMSG_SPACE(sizeof(uint32_t))  //control bytes per datagram
+
+// size has to be a power of two so positions can wrap around.
+void rxring_init(rxring__t *ring, int size, int bufsize)
+{
+    //keep every buffer aligned for the packet structs cast onto it
+    bufsize = (bufsize + 15) & ~15;
+
+    bzero(ring, sizeof(*ring));
+    ring->size = size;
+    ring->bufsize = bufsize;
+    ring->bufs = calloc(size, bufsize);
+    ring->iov = calloc(size, sizeof(struct iovec));
+    ring->msgs = calloc(size, sizeof(struct mmsghdr));
+    ring->addrs = calloc(size, sizeof(struct sockaddr_in));
+    ring->ctrl = calloc(size, RX_CTRL);
+    if (!ring->bufs || !ring->iov || !ring->msgs || !ring->addrs || !ring->ctrl) {
+        err_sys("  rxring_init(): ERROR allocating memory!\n\n");
+    }
+    if ((ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err_sys("  rxring_init(): eventfd() ERROR");
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->space, NULL);
+
+    for (int i = 0; i < size; i++) {
+        ring->iov[i].iov_base = ring->bufs + (size_t) i * bufsize;
+        ring->iov[i].iov_len = bufsize;
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+        ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+        ring->msgs[i].msg_hdr.msg_control = ring->ctrl + (size_t) i * RX_CTRL;
+    }
+}
+
+// Receiver side, call it when sockfd is readable.  Waits for room in the
+// ring, then reads up to max_datagrams waiting datagrams into the free
+// buffers starting at ring->head.  They stay invisible to the consumer until
+// rxring_publish(), so the receiver can look them over first.  Returns
+// how many were read.  A truncated datagram is kept with a length of 0.
+// If the socket has SO_RXQ_OVFL set, *drops is updated to its count of
+// datagrams dropped so far; it wraps, so compare it by difference.
+int rxring_recv(rxring__t *ring, int sockfd, int max_datagrams, uint32_t *drops)
+{
+    unsigned head = ring->head;
+    int n;
+
+    pthread_mutex_lock(&ring->lock);
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == (unsigned) ring->size) {
+        pthread_cond_wait(&ring->space, &ring->lock);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    //recvmmsg() wants the buffers side by side, so stop at the wrap
+    int first = head % ring->size;
+    int room = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if (room > ring->size - first) room = ring->size - first;
+    if (room > max_datagrams) room = max_datagrams;
+
+    for (int i = first; i < first + room; i++) {
+        ring->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        ring->msgs[i].msg_hdr.msg_flags = 0;
+        ring->msgs[i].msg_hdr.msg_controllen = RX_CTRL;
+    }
+
+    if ((n = recvmmsg(sockfd, &ring->msgs[first], room, MSG_DONTWAIT, NULL)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("  rxring_recv(): recvmmsg() error: %s\n", strerror(errno));
+        }
+        return 0;
+    }
+
+    for (int i = first; i < first + n; i++) {
+        if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            printf("  rxring_recv(): dropped truncated datagram from %s:%u\n",
+                   inet_ntoa(ring->addrs[i].sin_addr),
+                   ntohs(ring->addrs[i].sin_port));
+            ring->msgs[i].msg_len = 0;
+        }
+
+        //every datagram carries the count, the last one has the latest
+        struct msghdr *hdr = &ring->msgs[i].msg_hdr;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+            }
+        }
+    }
+
+    return n;
+}
+
+// Receiver side.  Hands the next n datagrams to the consumer.
+void rxring_publish(rxring__t *ring, int n)
+{
+    uint64_t one = 1;
+
+    if (n == 0) return;
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+    if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        printf("  rxring_publish(): eventfd write error: %s\n", strerror(errno));
+    }
+}
+
+// Receiver side.  How many buffers are free, counting the ones read since
+// the last rxring_publish() as free.
+int rxring_room(rxring__t *ring)
+{
+    return ring->size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+// Receiver side.  Moves the datagram read into from to to, where from and
+// to are both read but not published yet, so a receiver can close up the
+// gaps left by datagrams it drops.  to's buffer goes to from.
+void rxring_move(rxring__t *ring, unsigned to, unsigned from)
+{
+    int t = to % ring->size, f = from % ring->size;
+    void *buf = ring->iov[t].iov_base;
+
+    ring->iov[t].iov_base = ring->iov[f].iov_base;
+    ring->iov[f].iov_base = buf;
+    ring->msgs[t].msg_len = ring->msgs[f].msg_len;
+    ring->addrs[t] = ring->addrs[f];
+}
+
+// Consumer side.  Returns how many datagrams are waiting, starting at
+// ring->tail.  Call it from the callback for ring->efd, then either handle
+// them all or leave some with rxring_defer().
+int rxring_ready(rxring__t *ring)
+{
+    uint64_t count;
+
+    //anything published after this read makes the eventfd readable again
+    if (read(ring->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        printf("  rxring_ready(): eventfd read error: %s\n", strerror(errno));
+    }
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+// Consumer side.  Gives the n oldest datagrams' buffers back.
+void rxring_release(rxring__t *ring, int n)
+{
+    __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+
+    //the lock keeps the receiver from missing this between check and wait
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->space);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Consumer side.  Makes ring->efd readable again, for a consumer that
+// leaves some datagrams waiting until its next turn.
+void rxring_defer(rxring__t *ring)
+{
+    uint64_t one = 1;
+
+    if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        printf("  rxring_defer(): eventfd write error: %s\n", strerror(errno));
+    }
+}
+
+// seq is a position in the stream of datagrams, ring->tail + i or
+// ring->head + i.
+void *rxring_buf(rxring__t *ring, unsigned seq)
+{
+    return ring->iov[seq % ring->size].iov_base;
+}
+
+int rxring_len(rxring__t *ring, unsigned seq)
+{
+    return ring->msgs[seq % ring->size].msg_len;
+}
+
+struct sockaddr_in *rxring_addr(rxring__t *ring, unsigned seq)
+{
+    return &ring->addrs[seq % ring->size];
+}
+
+void rxring_free(rxring__t *ring)
+{
+    free(ring->bufs);
+    free(ring->iov);
+    free(ring->msgs);
+    free(ring->addrs);
+    free(ring->ctrl);
+    close(ring->efd);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->space);
+    bzero(ring, sizeof(*ring));
+}
+
+void txlist_init(txlist__t *tx)
+{
+    bzero(tx, sizeof(*tx));
+}
+
+void txlist_add(txlist__t *tx, struct sockaddr_in addr)
+{
+    if (tx->count >= tx->alloced) {
+        tx->alloced = (tx->alloced == 0)?(4):(tx->alloced * 2);
+        tx->addrs = realloc(tx->addrs, tx->alloced * sizeof(struct sockaddr_in));
+        tx->msgs = realloc(tx->msgs, tx->alloced * sizeof(struct mmsghdr));
+        tx->iov = realloc(tx->iov, tx->alloced * sizeof(struct iovec));
+        tx->fds = realloc(tx->fds, tx->alloced * sizeof(int));
+        tx->gathered = realloc(tx->gathered, tx->alloced * sizeof(struct mmsghdr));
+        if (!tx->addrs || !tx->msgs || !tx->iov || !tx->fds || !tx->gathered) {
+            err_sys("  txlist_add(): ERROR allocating memory!\n\n");
+        }
+        //the messages point into addrs and iov, which may have moved
+        for (int i = 0; i < tx->count; i++) {
+            tx->msgs[i].msg_hdr.msg_name = &tx->addrs[i];
+            tx->msgs[i].msg_hdr.msg_iov = &tx->iov[i];
+        }
+    }
+
+    int i = tx->count++;
+    tx->addrs[i] = addr;
+    tx->fds[i] = -1;
+    bzero(&tx->msgs[i], sizeof(struct mmsghdr));
+    tx->msgs[i].msg_hdr.msg_name = &tx->addrs[i];
+    tx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    tx->msgs[i].msg_hdr.msg_iov = &tx->iov[i];
+    tx->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// Sends to dest through sockfd instead of the socket passed to
+// txlist_send().  At most TX_SOCKETS different sockets per list.
+void txlist_set_socket(txlist__t *tx, int dest, int sockfd)
+{
+    int i;
+
+    for (i = 0; i < tx->num_socks && tx->socks[i] != sockfd; i++);
+    if (i == tx->num_socks) {
+        if (tx->num_socks == TX_SOCKETS) {
+            err_quit("  txlist_set_socket(): more than %d sockets in one send list\n", TX_SOCKETS);
+        }
+        tx->socks[tx->num_socks++] = sockfd;
+    }
+    tx->fds[dest] = sockfd;
+}
+
+// Sends msgs through sockfd, skipping the ones that fail.
+static int send_msgs(int sockfd, struct mmsghdr *msgs, int count)
+{
+    int sent = 0;
+
+    for (int i = 0; i < count; ) {
+        int n = sendmmsg(sockfd, &msgs[i], count - i, 0);
+        if (n < 0) {
+            struct sockaddr_in *addr = msgs[i].msg_hdr.msg_name;
+
+            if (errno == EINTR) continue;
+            //sendmmsg() only reports an error for the first message
+            printf("  txlist_send(): sendmmsg() to %s:%u error: %s\n",
+                   inet_ntoa(addr->sin_addr),
+                   ntohs(addr->sin_port),
+                   strerror(errno));
+            metric_add(METRIC_TX_ERRORS, 1);
+            i++;
+        } else {
+            sent += n;
+            i += n;
+        }
+    }
+    return sent;
+}
+
+// Sends buf to every destination with as few sendmmsg() calls as possible.
+// A destination that fails is reported and skipped instead of aborting the
+// rest of the list.  Returns how many destinations the datagram went to.
+int txlist_send(txlist__t *tx, int sockfd, const void *buf, size_t len)
+{
+    return txlist_send_patched(tx, sockfd, buf, len, NULL, 0);
+}
+
+// Same, but every destination that has patches gets its own copy of buf
+// with them applied.  Still one sendmmsg() for the lot.
+int txlist_send_patched(txlist__t *tx, int sockfd, const void *buf, size_t len,
+                        const txpatch__t *patches, int num_patches)
+{
+    int sent = 0, num_copies = 0;
+
+    for (int i = 0; i < tx->count; i++) {
+        tx->iov[i].iov_base = (void *) buf;
+        tx->iov[i].iov_len = len;
+    }
+
+    if (num_patches > 0) {
+        //room for a copy per destination that could have patches
+        size_t need = ((num_patches < tx->count)?(num_patches):(tx->count)) * len;
+        if (need > tx->copies_size) {
+            if ((tx->copies = realloc(tx->copies, need)) == NULL) {
+                err_sys("  txlist_send_patched(): ERROR allocating memory!\n\n");
+            }
+            tx->copies_size = need;
+        }
+        for (int i = 0; i < num_patches; i++) {
+            struct iovec *iov = &tx->iov[patches[i].dest];
+            if (iov->iov_base == buf) {
+                iov->iov_base = tx->copies + num_copies++ * len;
+                memcpy(iov->iov_base, buf, len);
+            }
+            memcpy((uint8_t *) iov->iov_base + patches[i].offset, &patches[i].value, sizeof(uint32_t));
+        }
+    }
+
+    if (tx->num_socks == 0) {
+        sent = send_msgs(sockfd, tx->msgs, tx->count);
+    } else {
+        //one sendmmsg() per socket, with its destinations copied side by side
+        for (int s = -1; s < tx->num_socks; s++) {
+            int fd = (s < 0)?(-1):(tx->socks[s]), n = 0;
+
+            for (int i = 0; i < tx->count; i++) {
+                if (tx->fds[i] == fd) tx->gathered[n++] = tx->msgs[i];
+            }
+            if (n > 0) sent += send_msgs((fd < 0)?(sockfd):(fd), tx->gathered, n);
+        }
+    }
+    metric_add(METRIC_TX_DATAGRAMS, sent);
+    metric_add(METRIC_TX_BYTES, (uint64_t) sent * len);
+
+    return sent;
+}
+
+void txlist_free(txlist__t *tx)
+{
+    free(tx->addrs);
+    free(tx->iov);
+    free(tx->msgs);
+    free(tx->copies);
+    free(tx->fds);
+    free(tx->gathered);
+    bzero(tx, sizeof(*tx));
+}
+
+void txqueue_init(txqueue__t *q)
+{
+    bzero(q, sizeof(*q));
+}
+
+static size_t txqueue_len(txqueue__t *q)
+{
+    return (q->count == 0)?(0):(q->ends[q->count - 1]);
+}
+
+// Returns room for one more datagram of up to maxlen bytes at the end of
+// the queue.  Write it, then txqueue_commit() how much was used.
+void *txqueue_reserve(txqueue__t *q, size_t maxlen)
+{
+    size_t len = txqueue_len(q);
+
+    if (len + maxlen > q->size) {
+        q->size = (q->size == 0)?(maxlen * 16):(q->size * 2);
+        if (q->size < len + maxlen) q->size = len + maxlen;
+        if ((q->buf = realloc(q->buf, q->size)) == NULL) {
+            err_sys("  txqueue_reserve(): ERROR allocating memory!\n\n");
+        }
+    }
+    if (q->count >= q->alloced) {
+        q->alloced = (q->alloced == 0)?(16):(q->alloced * 2);
+        q->ends = realloc(q->ends, q->alloced * sizeof(size_t));
+        q->patch_ends = realloc(q->patch_ends, q->alloced * sizeof(int));
+        if (!q->ends || !q->patch_ends) {
+            err_sys("  txqueue_reserve(): ERROR allocating memory!\n\n");
+        }
+    }
+
+    return q->buf + len;
+}
+
+// Patches the datagram being written (the last one reserved) for
+// destination dest of the send list: value replaces the 4 bytes at offset.
+void txqueue_patch(txqueue__t *q, size_t offset, int dest, uint32_t value)
+{
+    if (q->num_patches >= q->patches_alloced) {
+        q->patches_alloced = (q->patches_alloced == 0)?(64):(q->patches_alloced * 2);
+        if ((q->patches = realloc(q->patches, q->patches_alloced * sizeof(txpatch__t))) == NULL) {
+            err_sys("  txqueue_patch(): ERROR allocating memory!\n\n");
+        }
+    }
+    q->patches[q->num_patches].offset = offset;
+    q->patches[q->num_patches].dest = dest;
+    q->patches[q->num_patches].value = value;
+    q->num_patches++;
+}
+
+void txqueue_commit(txqueue__t *q, size_t len)
+{
+    q->ends[q->count] = txqueue_len(q) + len;
+    q->patch_ends[q->count] = q->num_patches;
+    q->count++;
+}
+
+// Drops everything that is queued, sent or not.  Keeps the memory.
+void txqueue_reset(txqueue__t *q)
+{
+    q->count = q->sent = q->num_patches = 0;
+}
+
+// Sends the next max_datagrams queued datagrams to every destination in
+// tx.  Returns how many datagrams are still waiting.
+int txqueue_send(txqueue__t *q, txlist__t *tx, int sockfd, int max_datagrams)
+{
+    for (int i = 0; i < max_datagrams && q->sent < q->count; i++, q->sent++) {
+        size_t start = (q->sent == 0)?(0):(q->ends[q->sent - 1]);
+        int first = (q->sent == 0)?(0):(q->patch_ends[q->sent - 1]);
+        txlist_send_patched(tx, sockfd, q->buf + start, q->ends[q->sent] - start,
+                            q->patches + first, q->patch_ends[q->sent] - first);
+    }
+
+    int left = q->count - q->sent;
+    if (left == 0) txqueue_reset(q);
+    return left;
+}
+
+void txqueue_free(txqueue__t *q)
+{
+    free(q->buf);
+    free(q->ends);
+    free(q->patch_ends);
+    free(q->patches);
+    bzero(q, sizeof(*q));
+}
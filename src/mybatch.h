@@ -0,0 +1,106 @@
+/*
+ * mybatch.h
+ *
+ * Batched datagram I/O.  A receive ring is a preallocated set of
+ * fixed-size buffers that recvmmsg() fills in one system call, so a
+ * burst of packets costs one syscall and no allocations.  One thread
+ * receives into it and another consumes from it without locking.  With
+ * SO_RXQ_OVFL set on the socket it also reports how many datagrams the
+ * kernel dropped for want of buffer space.  A send list
+ * is a fixed set of destinations that one buffer is sent to with a
+ * single sendmmsg().  A send queue holds encoded datagrams until they
+ * are sent to a send list a few at a time.  Destinations can be given
+ * their own socket, e.g. the one bound to the interface they are on.
+ *
+ * A datagram can carry patches: 4-byte values that replace what's at an
+ * offset, but only in the copy sent to one destination.  Destinations
+ * without patches still share the one buffer, so per-destination
+ * variants cost a copy and a few stores instead of another encoding.
+ */
+
+#ifndef MYBATCH_H
+#define MYBATCH_H
+
+#include "myunp.h"
+
+#define MAX_DATAGRAM 65507  //largest UDP payload over IPv4
+#define TX_SOCKETS 16       //most sockets one send list can spread over
+
+typedef struct {
+    int size;                  //number of buffers
+    int bufsize;
+    char *bufs;                //size * bufsize bytes, one allocation
+    struct iovec *iov;
+    struct mmsghdr *msgs;
+    struct sockaddr_in *addrs;
+    char *ctrl;                //room for each datagram's SO_RXQ_OVFL count
+    unsigned head;             //datagrams ever received, only the receiver writes it
+    unsigned tail;             //datagrams ever handed back, only the consumer writes it
+    int efd;                   //eventfd, readable while datagrams are waiting
+    pthread_mutex_t lock;      //only for a receiver waiting on a full ring
+    pthread_cond_t space;
+} rxring__t;
+
+void rxring_init(rxring__t *ring, int size, int bufsize);
+int rxring_recv(rxring__t *ring, int sockfd, int max_datagrams, uint32_t *drops);
+void rxring_publish(rxring__t *ring, int n);
+int rxring_room(rxring__t *ring);
+void rxring_move(rxring__t *ring, unsigned to, unsigned from);
+int rxring_ready(rxring__t *ring);
+void rxring_release(rxring__t *ring, int n);
+void rxring_defer(rxring__t *ring);
+void *rxring_buf(rxring__t *ring, unsigned seq);
+int rxring_len(rxring__t *ring, unsigned seq);
+struct sockaddr_in *rxring_addr(rxring__t *ring, unsigned seq);
+void rxring_free(rxring__t *ring);
+
+typedef struct {
+    uint32_t offset;           //in the datagram
+    uint32_t dest;             //index in the send list
+    uint32_t value;            //stored as is, so already in network byte order
+} txpatch__t;
+
+typedef struct {
+    int count;                 //number of destinations
+    int alloced;
+    struct sockaddr_in *addrs;
+    struct iovec *iov;         //one per message, most point at the same buffer
+    struct mmsghdr *msgs;
+    uint8_t *copies;           //patched copies of the datagram being sent
+    size_t copies_size;
+    int *fds;                  //socket per destination, -1 = the one passed in
+    int socks[TX_SOCKETS];     //the different ones in fds
+    int num_socks;
+    struct mmsghdr *gathered;  //one socket's messages, side by side for sendmmsg()
+} txlist__t;
+
+void txlist_init(txlist__t *tx);
+void txlist_add(txlist__t *tx, struct sockaddr_in addr);
+void txlist_set_socket(txlist__t *tx, int dest, int sockfd);
+int txlist_send(txlist__t *tx, int sockfd, const void *buf, size_t len);
+int txlist_send_patched(txlist__t *tx, int sockfd, const void *buf, size_t len,
+                        const txpatch__t *patches, int num_patches);
+void txlist_free(txlist__t *tx);
+
+typedef struct {
+    uint8_t *buf;              //datagrams back to back
+    size_t size;
+    size_t *ends;              //end offset of each datagram in buf
+    int *patch_ends;           //end index of each datagram's patches
+    int count;                 //datagrams queued
+    int alloced;
+    int sent;                  //datagrams already sent
+    txpatch__t *patches;       //all datagrams' patches, in datagram order
+    int num_patches;
+    int patches_alloced;
+} txqueue__t;
+
+void txqueue_init(txqueue__t *q);
+void *txqueue_reserve(txqueue__t *q, size_t maxlen);
+void txqueue_patch(txqueue__t *q, size_t offset, int dest, uint32_t value);
+void txqueue_commit(txqueue__t *q, size_t len);
+void txqueue_reset(txqueue__t *q);
+int txqueue_send(txqueue__t *q, txlist__t *tx, int sockfd, int max_datagrams);
+void txqueue_free(txqueue__t *q);
+
+#endif
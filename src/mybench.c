@@ -0,0 +1,412 @@
+/*
+ * mybench.c
+ *
+ * Usage: ./mybench [-n max_routes] [-b baseline] [-r percent]
+ *
+ *   -n  largest table to try (default 1000000), sizes go up by 10x from 1000
+ *   -b  output of an earlier run to compare against
+ *   -r  how much slower than the baseline counts as a regression
+ *       (default 10 percent).  Exits with 1 if anything regressed.
+ *
+ * Times the route code's hot paths on synthetic tables: get_node() and
+ * is_neighbor() lookups, update_routes() on a stream of encoded updates,
+ * and building a full dump with create_route_packet().  Each result line
+ * is
+ *
+ *   name  routes  ns/entry  packets/s  allocs/packet
+ *
+ * where an entry is one lookup or one route, and "-" means it doesn't
+ * apply.  Allocations are counted by wrapping glibc's malloc(), calloc()
+ * and realloc().
+ *
+ * Each table size gets REPEATS rounds of every benchmark, taken in turn,
+ * and the fastest round of each is what's reported.  A slow stretch on a
+ * busy machine then costs one round of each benchmark instead of all of
+ * one benchmark's, which is what made single runs too noisy to compare.
+ */
+
+#include "myroute.h"
+#include "mybatch.h"
+#include "mysnap.h"
+#include "myencode.h"
+
+#define MIN_ROUTES 1000
+#define MAX_ROUTES 1000000
+#define NUM_NEIGHBORS 8
+#define NUM_UPDATES 4096    //distinct update packets, replayed in a loop
+#define NUM_LOOKUPS 65536   //distinct lookup keys, likewise
+#define MIN_TIME 0.25       //seconds each round runs for at least
+#define REPEATS 8           //rounds per benchmark, the fastest counts
+#define REGRESSION 10       //percent
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+typedef struct {
+    char name[32];
+    int routes;
+    double ns;
+} benchresult__t;
+
+typedef struct {
+    double ns;              //fastest round so far, per entry, -1 before the first
+    double pps;             //packets/s in that round, -1 if it doesn't apply
+    long packets;           //packets handled in all rounds
+    long allocs;            //allocations in all rounds
+} timing__t;
+
+#define TIMING_INIT {-1, -1, 0, 0}
+
+long allocations = 0;
+router__t router;
+txqueue__t txqueue;
+int packet_size = RIP_MAX_PACKET;
+int packets_built;
+node__t *neighbors[NUM_NEIGHBORS];
+uint32_t neighbor_ids[NUM_NEIGHBORS];  //ascending, as the daemon keeps them
+uint32_t *dests;            //NUM_LOOKUPS destinations that are in the table
+uint8_t *updates;           //NUM_UPDATES encoded packets, packet_size apart
+size_t update_len[NUM_UPDATES];
+node__t *update_from[NUM_UPDATES];
+benchresult__t *baseline = NULL;
+int num_baseline = 0;
+int regressions = 0;
+double threshold = REGRESSION;
+
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *ptr, size_t size);
+double now_sec();
+void load_baseline(char *fp);
+void result(char *name, int routes, timing__t *t);
+void best_round(timing__t *t, double ns, double pps);
+void build_table(int num_routes);
+void build_updates();
+void bench_get_node(timing__t *t);
+void bench_is_neighbor(timing__t *t);
+void bench_update_routes(timing__t *t);
+void bench_full_dump(timing__t *t, int num_routes);
+time_t bench_now(router__t *r);
+void bench_set_timer(router__t *r, int timer, time_t when);
+void bench_send_full(router__t *r);
+void bench_send_changed(router__t *r, routeentry__t *routes, int count);
+
+const routeops__t bench_ops = {bench_now, bench_set_timer, bench_send_full, bench_send_changed, NULL};
+
+int main(int argc, char **argv)
+{
+    int opt, max_routes = MAX_ROUTES;
+
+    while ((opt = getopt(argc, argv, "n:b:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_routes = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            load_baseline(optarg);
+            break;
+        case 'r':
+            threshold = strtod(optarg, NULL);
+            break;
+        default:
+            printf("Usage: %s [-n max_routes] [-b baseline] [-r percent]\n\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    srand(1);  //the same tables and updates every run
+    txqueue_init(&txqueue);
+    if ((dests = malloc(NUM_LOOKUPS * sizeof(uint32_t))) == NULL
+            || (updates = malloc((size_t) NUM_UPDATES * packet_size)) == NULL) {
+        err_sys("  main(): ERROR allocating memory!\n\n");
+    }
+
+    printf("# %-16s %8s %10s %12s %14s\n", "name", "routes", "ns/entry", "packets/s", "allocs/packet");
+    for (int num_routes = MIN_ROUTES; num_routes <= max_routes; num_routes *= 10) {
+        timing__t get = TIMING_INIT, nbr = TIMING_INIT, upd = TIMING_INIT, dump = TIMING_INIT;
+
+        build_table(num_routes);
+        build_updates();
+        for (int round = 0; round < REPEATS; round++) {
+            bench_get_node(&get);
+            bench_is_neighbor(&nbr);
+            bench_update_routes(&upd);
+            bench_full_dump(&dump, num_routes);
+        }
+        result("get_node", num_routes, &get);
+        result("is_neighbor", num_routes, &nbr);
+        result("update_routes", num_routes, &upd);
+        result("full_dump", num_routes, &dump);
+        router_free(&router);
+    }
+
+    txqueue_free(&txqueue);
+    free(dests);
+    free(updates);
+    free(baseline);
+    return (regressions > 0)?(1):(0);
+}
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void load_baseline(char *basefp)
+{
+    char buffer[200];
+    int alloced = 0;
+    FILE *fp = fopen(basefp, "r");
+
+    if (!fp) {
+        printf("  load_baseline(): fopen(%s) ERROR.\n\n", basefp);
+        exit(2);
+    }
+
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        benchresult__t res;
+        if (buffer[0] == '#' || sscanf(buffer, "%31s %d %lf", res.name, &res.routes, &res.ns) != 3) {
+            continue;
+        }
+        if (num_baseline >= alloced) {
+            alloced = (alloced == 0)?(32):(alloced * 2);
+            if ((baseline = realloc(baseline, alloced * sizeof(benchresult__t))) == NULL) {
+                err_sys("  load_baseline(): ERROR allocating memory!\n\n");
+            }
+        }
+        baseline[num_baseline++] = res;
+    }
+    fclose(fp);
+}
+
+// Prints one result line, with "-" for what doesn't apply, and compares
+// it with the baseline if there is one.
+void result(char *name, int routes, timing__t *t)
+{
+    char pps[32] = "-", apk[32] = "-";
+    double ns = t->ns;
+
+    if (t->pps >= 0) snprintf(pps, sizeof(pps), "%.0f", t->pps);
+    if (t->packets > 0) snprintf(apk, sizeof(apk), "%.3f", (double) t->allocs / t->packets);
+    printf("  %-16s %8d %10.1f %12s %14s", name, routes, ns, pps, apk);
+
+    for (int i = 0; i < num_baseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0 && baseline[i].routes == routes) {
+            double change = 100.0 * (ns - baseline[i].ns) / baseline[i].ns;
+            printf("   %+6.1f%%", change);
+            if (change > threshold) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+            break;
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Keeps the round if it's the fastest yet.
+void best_round(timing__t *t, double ns, double pps)
+{
+    if (t->ns < 0 || ns < t->ns) {
+        t->ns = ns;
+        t->pps = pps;
+    }
+}
+
+// A router with NUM_NEIGHBORS neighbors and num_routes routes through
+// them to random destinations.
+void build_table(int num_routes)
+{
+    router_init(&router, num_routes, &bench_ops, NULL);
+    router.table_limit = num_routes;
+
+    for (int i = 0; i <= NUM_NEIGHBORS; i++) {
+        node__t *node = topo_insert(&router.topo, i + 1);
+        node->destaddr.sin_family = AF_INET;
+        node->destaddr.sin_addr.s_addr = htonl(0x7f000001);
+        node->destaddr.sin_port = htons(16000 + i);
+        topo_index_addr(&router.topo, node);
+        if (i == 0) {
+            node->next_hop = 1;
+            router.self = node;
+        } else {
+            node->distance = node->cost = 1 + rand() % 3;
+            node->next_hop = node->destination;
+            node->neighbor = 1;
+            neighbors[i - 1] = node;
+            neighbor_ids[i - 1] = node->destination;
+        }
+    }
+
+    while (sizeof_topo(&router) < num_routes) {
+        node__t *node = topo_insert(&router.topo, (uint32_t) rand() << 1 | (rand() & 1));
+        if (!node) continue;  //already there, or 0
+        node__t *via = neighbors[rand() % NUM_NEIGHBORS];
+        node->distance = via->cost + rand() % 10;
+        node->next_hop = via->destination;
+        node->learned = 1;
+    }
+
+    router_start(&router);
+
+    //random destinations that are in the table
+    for (int i = 0; i < NUM_LOOKUPS; i++) {
+        node__t *node;
+        do {
+            node = topo_node(&router.topo, rand() % router.topo.used);
+        } while (node->destination == 0);
+        dests[i] = node->destination;
+    }
+}
+
+// Full update packets from random neighbors.  Most entries repeat what
+// the table already has, the rest are better or worse routes.
+void build_updates()
+{
+    for (int i = 0; i < NUM_UPDATES; i++) {
+        ripwriter__t w;
+        node__t *from = neighbors[rand() % NUM_NEIGHBORS];
+
+        rip_writer_init(&w, updates + (size_t) i * packet_size, packet_size, RIP_RESPONSE);
+        for (;;) {
+            node__t *node = get_node(&router, dests[rand() % NUM_LOOKUPS]);
+            uint32_t metric = (node->distance > from->cost)?(node->distance - from->cost):(0);
+            if (rand() % 4 == 0) metric = rand() % RIP_INFINITY;
+            if (!rip_put_entry(&w, node->destination, metric)) break;
+        }
+        update_len[i] = w.len;
+        update_from[i] = from;
+    }
+}
+
+void bench_get_node(timing__t *t)
+{
+    long lookups = 0;
+    uint32_t found = 0;
+    double start = now_sec(), elapsed;
+
+    do {
+        for (int i = 0; i < NUM_LOOKUPS; i++) {
+            found += get_node(&router, dests[i])->distance;
+        }
+        lookups += NUM_LOOKUPS;
+    } while ((elapsed = now_sec() - start) < MIN_TIME);
+
+    if (found == 1) printf("\n");  //keeps the loop from being optimized away
+    best_round(t, elapsed * 1e9 / lookups, -1);
+}
+
+void bench_is_neighbor(timing__t *t)
+{
+    struct sockaddr_in addrs[NUM_NEIGHBORS + 1];
+    long lookups = 0, found = 0;
+    double start, elapsed;
+
+    //every neighbor, plus one stranger
+    for (int i = 0; i < NUM_NEIGHBORS; i++) {
+        addrs[i] = neighbors[i]->destaddr;
+    }
+    addrs[NUM_NEIGHBORS] = neighbors[0]->destaddr;
+    addrs[NUM_NEIGHBORS].sin_port = htons(1);
+
+    start = now_sec();
+    do {
+        for (int i = 0; i < NUM_LOOKUPS; i++) {
+            found += (is_neighbor(&router, addrs[i % (NUM_NEIGHBORS + 1)]) != NULL);
+        }
+        lookups += NUM_LOOKUPS;
+    } while ((elapsed = now_sec() - start) < MIN_TIME);
+
+    if (found == 1) printf("\n");
+    best_round(t, elapsed * 1e9 / lookups, -1);
+}
+
+void bench_update_routes(timing__t *t)
+{
+    long packets = 0, entries = 0, allocs = allocations;
+    double start = now_sec(), elapsed;
+
+    do {
+        for (int i = 0; i < NUM_UPDATES; i++) {
+            ripreader__t rd;
+            entries += rip_reader_init(&rd, updates + (size_t) i * packet_size, update_len[i]);
+            update_routes(&router, &rd, update_from[i]);
+        }
+        packets += NUM_UPDATES;
+    } while ((elapsed = now_sec() - start) < MIN_TIME);
+
+    t->allocs += allocations - allocs;
+    t->packets += packets;
+    best_round(t, elapsed * 1e9 / entries, packets / elapsed);
+}
+
+void bench_full_dump(timing__t *t, int num_routes)
+{
+    long dumps = 0, allocs;
+    double start, elapsed;
+
+    //the first dump sizes the send queue, after that only the snapshot allocates
+    if (t->packets == 0) create_route_packet(&router, 0);
+    packets_built = 0;
+    allocs = allocations;
+    start = now_sec();
+
+    do {
+        create_route_packet(&router, 0);
+        dumps++;
+    } while ((elapsed = now_sec() - start) < MIN_TIME);
+
+    t->allocs += allocations - allocs;
+    t->packets += packets_built;
+    best_round(t, elapsed * 1e9 / (dumps * (double) num_routes), packets_built / elapsed);
+}
+
+time_t bench_now(router__t *r)
+{
+    return 1000;
+}
+
+void bench_set_timer(router__t *r, int timer, time_t when)
+{
+}
+
+// What the daemon does with a full dump: snapshot the table, then
+// encode the snapshot's runs of advertised routes as the sender does.
+void bench_send_full(router__t *r)
+{
+    encoder__t e;
+    snapshot__t *snap = snap_build(&r->topo, NULL);
+
+    txqueue_reset(&txqueue);
+    encode_begin(&e, &txqueue, neighbor_ids, NUM_NEIGHBORS, packet_size);
+    encode_snapshot(&e, snap);
+    encode_end(&e);
+    packets_built += e.datagrams;
+    free(snap);
+}
+
+void bench_send_changed(router__t *r, routeentry__t *routes, int count)
+{
+}
@@ -0,0 +1,117 @@
+/*
+ * mycoalesce.c
+ *
+ * Finds route entries that a newer update from the same neighbor has
+ * made stale while both still wait to be processed.  A neighbor's
+ * latest word about a destination is all that counts, so when the route
+ * thread is behind it can skip the older entries and a neighbor that
+ * floods us costs one entry per destination rather than one per update.
+ *
+ * The index maps (source, destination) to where the newest entry for it
+ * is: a position in the receive ring and an offset in that datagram.
+ * Clearing it for the next backlog is O(1), every slot carries the
+ * generation it was written in.  It holds at most max entries: when it
+ * is full, the slots for datagrams already processed are dropped, and if
+ * that doesn't free half of it everything goes, which only costs the
+ * chance to skip some of the waiting entries.
+ */
+
+#include "mycoalesce.h"
+
+#define COALESCE_MIN 1024    //slots to start with, a power of two
+
+static unsigned coalesce_hash(uint64_t source, uint32_t destination)
+{
+    uint64_t h = (source ^ ((uint64_t) destination << 32 | destination)) * 0x9e3779b97f4a7c15ULL;
+    return h >> 32;
+}
+
+void coalesce_init(coalescer__t *c, int max)
+{
+    bzero(c, sizeof(*c));
+    c->generation = 1;
+    c->max = max;
+}
+
+// Moves this generation's slots into a new table of size slots, leaving
+// out those for datagrams before oldest.
+static void coalesce_rehash(coalescer__t *c, int size, unsigned oldest)
+{
+    coalesceslot__t *old = c->slots;
+    int old_size = c->size;
+
+    c->size = size;
+    c->used = 0;
+    if ((c->slots = calloc(c->size, sizeof(coalesceslot__t))) == NULL) {
+        err_sys("  coalesce_rehash(): ERROR allocating memory!\n\n");
+    }
+
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].generation != c->generation || (int) (old[i].seq - oldest) < 0) continue;
+
+        unsigned k = coalesce_hash(old[i].source, old[i].destination) & (c->size - 1);
+        while (c->slots[k].generation == c->generation) k = (k + 1) & (c->size - 1);
+        c->slots[k] = old[i];
+        c->used++;
+    }
+    free(old);
+}
+
+// Records that datagram seq has an entry at offset for destination from
+// source, which is whatever tells two neighbors (or the same neighbor
+// talking to two of our nodes) apart.  If a datagram from oldest on, so
+// one not processed yet, has an entry for the same pair, returns 1 and
+// where that entry is; it is stale now.  Otherwise returns 0.
+int coalesce_add(coalescer__t *c, uint64_t source, uint32_t destination, unsigned seq, uint32_t offset,
+                 unsigned oldest, unsigned *old_seq, uint32_t *old_offset)
+{
+    if (c->used >= c->max) {
+        coalesce_rehash(c, c->size, oldest);
+        if (c->used * 2 > c->max) coalesce_reset(c);
+    }
+    if (c->used * 2 >= c->size) {
+        coalesce_rehash(c, (c->size)?(c->size * 2):(COALESCE_MIN), oldest);
+    }
+
+    unsigned k = coalesce_hash(source, destination) & (c->size - 1);
+    for (;;) {
+        coalesceslot__t *slot = &c->slots[k];
+
+        if (slot->generation != c->generation) {
+            slot->source = source;
+            slot->destination = destination;
+            slot->generation = c->generation;
+            slot->seq = seq;
+            slot->offset = offset;
+            c->used++;
+            return 0;
+        }
+        if (slot->source == source && slot->destination == destination) {
+            int stale = ((int) (slot->seq - oldest) >= 0);
+            *old_seq = slot->seq;
+            *old_offset = slot->offset;
+            slot->seq = seq;
+            slot->offset = offset;
+            return stale;
+        }
+        k = (k + 1) & (c->size - 1);
+    }
+}
+
+// Forgets everything, once the backlog it was built for is gone.
+void coalesce_reset(coalescer__t *c)
+{
+    if (c->used == 0) return;
+    c->used = 0;
+    if (++c->generation == 0) {
+        //wrapped, old slots could look current again
+        bzero(c->slots, c->size * sizeof(coalesceslot__t));
+        c->generation = 1;
+    }
+}
+
+void coalesce_free(coalescer__t *c)
+{
+    free(c->slots);
+    bzero(c, sizeof(*c));
+}
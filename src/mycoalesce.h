@@ -0,0 +1,47 @@
+/*
+ * mycoalesce.h
+ *
+ * Finds route entries that a newer update from the same neighbor has
+ * made stale while both still wait to be processed.  A neighbor's
+ * latest word about a destination is all that counts, so when the route
+ * thread is behind it can skip the older entries and a neighbor that
+ * floods us costs one entry per destination rather than one per update.
+ *
+ * The index maps (source, destination) to where the newest entry for it
+ * is: a position in the receive ring and an offset in that datagram.
+ * Clearing it for the next backlog is O(1), every slot carries the
+ * generation it was written in.  It holds at most max entries: when it
+ * is full, the slots for datagrams already processed are dropped, and if
+ * that doesn't free half of it everything goes, which only costs the
+ * chance to skip some of the waiting entries.
+ */
+
+#ifndef MYCOALESCE_H
+#define MYCOALESCE_H
+
+#include <stdint.h>
+#include "myunp.h"
+
+typedef struct {
+    uint64_t source;           //who sent it, see coalesce_add()
+    uint32_t destination;
+    uint32_t generation;       //slot is empty unless this is the index's
+    unsigned seq;              //ring position of the datagram
+    uint32_t offset;           //of the entry in the datagram
+} coalesceslot__t;
+
+typedef struct {
+    coalesceslot__t *slots;
+    int size;                  //a power of two
+    int used;                  //slots of this generation
+    int max;                   //used is kept at or below this
+    uint32_t generation;
+} coalescer__t;
+
+void coalesce_init(coalescer__t *c, int max);
+int coalesce_add(coalescer__t *c, uint64_t source, uint32_t destination, unsigned seq, uint32_t offset,
+                 unsigned oldest, unsigned *old_seq, uint32_t *old_offset);
+void coalesce_reset(coalescer__t *c);
+void coalesce_free(coalescer__t *c);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * myconfig.c
+ *
+ * Reads node.config and neighbor.config.  The file is mapped into
+ * memory and parsed in one pass without copying lines or calling
+ * sscanf(), so million-line configs load in a fraction of a second.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "myconfig.h"
+
+// Maps path.  Returns -1 with errno set if it can't be read.
+int config_open(config__t *c, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    bzero(c, sizeof(*c));
+    c->path = path;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    c->size = st.st_size;
+    if (c->size > 0) {
+        void *map = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, c->size, MADV_SEQUENTIAL);
+        c->map = map;
+    }
+    close(fd);
+
+    c->p = c->map;
+    return 0;
+}
+
+// Roughly how many records there are, for sizing tables up front.
+int config_lines(config__t *c)
+{
+    const char *p = c->map, *end = c->map + c->size;
+    int lines = 0;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        lines++;
+        p++;
+    }
+    return lines + 1;
+}
+
+static void config_report(config__t *c, const char *kind, const char *fmt, va_list ap)
+{
+    printf("%s:%d: %s", c->path, c->line, kind);
+    vprintf(fmt, ap);
+    printf("\n");
+}
+
+// Reports a problem with the record last returned (or being parsed).
+void config_error(config__t *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (++c->errors > CONFIG_MAX_ERRORS) return;
+    va_start(ap, fmt);
+    config_report(c, "", fmt, ap);
+    va_end(ap);
+}
+
+// Same, for problems that aren't counted as errors.
+void config_warn(config__t *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    config_report(c, "warning: ", fmt, ap);
+    va_end(ap);
+}
+
+static int blank(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+static void skip_blanks(config__t *c)
+{
+    while (c->p < c->eol && blank(*c->p)) c->p++;
+}
+
+// Moves to the next line with something on it.  Returns 0 at the end.
+static int next_line(config__t *c)
+{
+    const char *end = c->map + c->size;
+
+    for (;;) {
+        if (c->p == NULL || c->p >= end) return 0;
+
+        c->line++;
+        if ((c->eol = memchr(c->p, '\n', end - c->p)) == NULL) c->eol = end;
+        skip_blanks(c);
+        if (c->p < c->eol && *c->p != '#') return 1;
+        c->p = c->eol + 1;
+    }
+}
+
+static void skip_line(config__t *c)
+{
+    c->p = c->eol + 1;
+}
+
+// The rest of the line may only be blanks or a comment.
+static int end_of_record(config__t *c)
+{
+    skip_blanks(c);
+    if (c->p < c->eol && *c->p != '#') {
+        config_error(c, "unexpected \"%.*s\" at the end of the line", (int) (c->eol - c->p), c->p);
+        return 0;
+    }
+    return 1;
+}
+
+// A decimal number up to max, then a blank or the end of the line.
+static int parse_uint(config__t *c, uint32_t *value, uint32_t max, const char *what)
+{
+    const char *start;
+    uint64_t v = 0;
+
+    skip_blanks(c);
+    start = c->p;
+    while (c->p < c->eol && *c->p >= '0' && *c->p <= '9' && v <= max) {
+        v = v * 10 + (*c->p++ - '0');
+    }
+    if (c->p == start || v > max || (c->p < c->eol && !blank(*c->p) && *c->p != '#')) {
+        while (c->p < c->eol && !blank(*c->p)) c->p++;
+        if (c->p == start) {
+            config_error(c, "missing %s", what);
+        } else {
+            config_error(c, "bad %s \"%.*s\"", what, (int) (c->p - start), start);
+        }
+        return 0;
+    }
+    *value = v;
+    return 1;
+}
+
+// A dotted quad, a.b.c.d with each part 0-255.
+static int parse_ipv4(config__t *c, struct in_addr *addr)
+{
+    uint32_t ip = 0;
+    const char *start;
+    int ok = 1;
+
+    skip_blanks(c);
+    start = c->p;
+    for (int i = 0; i < 4 && ok; i++) {
+        uint32_t part = 0;
+        int digits = 0;
+
+        while (c->p < c->eol && *c->p >= '0' && *c->p <= '9' && digits < 4) {
+            part = part * 10 + (*c->p++ - '0');
+            digits++;
+        }
+        if (digits == 0 || digits > 3 || part > 255 || (i < 3 && (c->p >= c->eol || *c->p++ != '.'))) {
+            ok = 0;
+        }
+        ip = (ip << 8) | part;
+    }
+    if (!ok || (c->p < c->eol && !blank(*c->p))) {
+        while (c->p < c->eol && !blank(*c->p)) c->p++;
+        config_error(c, "bad IPv4 address \"%.*s\"", (int) (c->p - start), start);
+        return 0;
+    }
+    addr->s_addr = htonl(ip);
+    return 1;
+}
+
+// Reads the next well-formed node.config line.  Returns 0 at the end.
+int config_node(config__t *c, uint32_t *id, struct sockaddr_in *addr)
+{
+    while (next_line(c)) {
+        uint32_t port;
+
+        bzero(addr, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        if (parse_uint(c, id, UINT32_MAX, "node id") && parse_ipv4(c, &addr->sin_addr)
+                && parse_uint(c, &port, 65535, "port") && end_of_record(c)) {
+            skip_line(c);
+            if (*id == 0) {
+                config_error(c, "node id 0 is reserved");
+                continue;
+            }
+            if (port == 0) {
+                config_error(c, "port 0 isn't usable");
+                continue;
+            }
+            addr->sin_port = htons(port);
+            return 1;
+        }
+        skip_line(c);
+    }
+    return 0;
+}
+
+// Reads the next well-formed neighbor.config line.  Returns 0 at the end.
+int config_link(config__t *c, uint32_t *from, uint32_t *to, uint32_t *cost)
+{
+    while (next_line(c)) {
+        if (parse_uint(c, from, UINT32_MAX, "node id") && parse_uint(c, to, UINT32_MAX, "node id")
+                && parse_uint(c, cost, UINT32_MAX, "cost") && end_of_record(c)) {
+            skip_line(c);
+            return 1;
+        }
+        skip_line(c);
+    }
+    return 0;
+}
+
+// Unmaps the file and returns how many errors were reported.
+int config_close(config__t *c)
+{
+    if (c->errors > CONFIG_MAX_ERRORS) {
+        printf("%s: %d more errors\n", c->path, c->errors - CONFIG_MAX_ERRORS);
+    }
+    if (c->map) munmap((void *) c->map, c->size);
+    return c->errors;
+}
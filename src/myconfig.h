@@ -0,0 +1,43 @@
+/*
+ * myconfig.h
+ *
+ * Reads node.config and neighbor.config.  The file is mapped into
+ * memory and parsed in one pass without copying lines or calling
+ * sscanf(), so million-line configs load in a fraction of a second.
+ *
+ *   node.config:      <id> <IPv4 address> <port>
+ *   neighbor.config:  <id> <id> <cost>
+ *
+ * Fields are separated by blanks.  Empty lines and lines starting with
+ * # are skipped, as is a # comment after the last field.  Anything else
+ * that doesn't parse is reported as path:line: message and skipped, and
+ * the caller decides at config_close() whether to carry on.
+ */
+
+#ifndef MYCONFIG_H
+#define MYCONFIG_H
+
+#include <stdint.h>
+#include "myunp.h"
+
+#define CONFIG_MAX_ERRORS 20    //reported, the rest are only counted
+
+typedef struct {
+    const char *path;
+    const char *map;            //the whole file, NULL if it's empty
+    size_t size;
+    const char *p;              //next unread byte
+    const char *eol;            //end of the current line
+    int line;                   //of the record last returned
+    int errors;
+} config__t;
+
+int config_open(config__t *c, const char *path);
+int config_lines(config__t *c);
+int config_node(config__t *c, uint32_t *id, struct sockaddr_in *addr);
+int config_link(config__t *c, uint32_t *from, uint32_t *to, uint32_t *cost);
+void config_error(config__t *c, const char *fmt, ...);
+void config_warn(config__t *c, const char *fmt, ...);
+int config_close(config__t *c);
+
+#endif
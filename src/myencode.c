@@ -0,0 +1,118 @@
+/*
+ * myencode.c
+ *
+ * Encodes routes into a send queue (see mybatch.h) for a list of
+ * neighbors, with poisoned reverse: the copy that goes to a route's next
+ * hops says it is unreachable, so two neighbors never count to infinity
+ * through each other.  The daemon's sender thread and mybench both use
+ * it, so the benchmark times the encoding the daemon does.
+ */
+
+#include "myencode.h"
+
+int cmp_id(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns id's index in the send list, or -1.
+static int neighbor_slot(encoder__t *e, uint32_t id)
+{
+    const uint32_t *found = bsearch(&id, e->neighbor_ids, e->num_neighbors, sizeof(uint32_t), cmp_id);
+    return (found)?(found - e->neighbor_ids):(-1);
+}
+
+// Makes the metric at offset in the datagram being built unreachable in
+// next_hop's copy.
+static void poison_route(encoder__t *e, size_t offset, uint32_t next_hop)
+{
+    int slot;
+
+    if ((slot = neighbor_slot(e, next_hop)) >= 0) {
+        txqueue_patch(e->queue, offset, slot, htonl(RIP_INFINITY));
+    }
+}
+
+// Commits the datagram being built, if any, and starts another.
+static void next_datagram(encoder__t *e)
+{
+    if (e->w.buf != NULL) {
+        txqueue_commit(e->queue, e->w.len);
+        e->datagrams++;
+    }
+    rip_writer_init(&e->w, txqueue_reserve(e->queue, e->packet_size), e->packet_size, RIP_RESPONSE);
+}
+
+// Appends to what is already in queue.  neighbor_ids has to stay put
+// until encode_end().
+void encode_begin(encoder__t *e, txqueue__t *queue, const uint32_t *neighbor_ids, int num_neighbors, size_t packet_size)
+{
+    e->queue = queue;
+    e->neighbor_ids = neighbor_ids;
+    e->num_neighbors = num_neighbors;
+    e->packet_size = packet_size;
+    e->w.buf = NULL;
+    e->datagrams = 0;
+}
+
+// Encodes a route into the datagram being built, starting a new one in
+// the queue when that one is full, and poisons it for next_hop and
+// more_hops (TOPO_PATHS - 1 of them, 0 = unused).
+void encode_route(encoder__t *e, uint32_t destination, uint32_t metric, uint32_t next_hop, const uint32_t *more_hops)
+{
+    if (e->w.buf == NULL || !rip_put_entry(&e->w, destination, metric)) {
+        next_datagram(e);
+        rip_put_entry(&e->w, destination, metric);
+    }
+    if (metric >= RIP_INFINITY) return;
+
+    poison_route(e, rip_last_metric(&e->w), next_hop);
+    for (int i = 0; i < TOPO_PATHS - 1 && more_hops[i] != 0; i++) {
+        poison_route(e, rip_last_metric(&e->w), more_hops[i]);
+    }
+}
+
+// encode_route() for every advertised route in snap, see SNAP_ADVERTISED.
+// Runs of them are encoded a datagram's worth at a time straight from
+// the snapshot's arrays.  Returns how many routes it encoded.
+int encode_snapshot(encoder__t *e, snapshot__t *snap)
+{
+    int count = 0;
+
+    for (int first = 0, end; first < snap->count; first = end) {
+        if (!(snap->flags[first] & SNAP_ADVERTISED)) {
+            end = first + 1;
+            continue;
+        }
+        for (end = first + 1; end < snap->count && (snap->flags[end] & SNAP_ADVERTISED); end++);
+        count += end - first;
+
+        while (first < end) {
+            if (e->w.buf == NULL || e->w.len + RIP_ENTRY_SIZE > e->w.size) next_datagram(e);
+
+            size_t start = e->w.len;
+            int n = rip_put_entries(&e->w, &snap->destination[first], &snap->metric[first], end - first);
+            for (int i = 0; i < n; i++) {
+                if (snap->metric[first + i] >= RIP_INFINITY) continue;
+
+                size_t offset = start + i * RIP_ENTRY_SIZE + RIP_METRIC_OFFSET;
+                for (int h = 0; h < TOPO_PATHS && snap->hops[first + i][h] != 0; h++) {
+                    poison_route(e, offset, snap->hops[first + i][h]);
+                }
+            }
+            first += n;
+        }
+    }
+    return count;
+}
+
+// Commits the last datagram.
+void encode_end(encoder__t *e)
+{
+    if (e->w.buf != NULL) {
+        txqueue_commit(e->queue, e->w.len);
+        e->datagrams++;
+        e->w.buf = NULL;
+    }
+}
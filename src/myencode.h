@@ -0,0 +1,34 @@
+/*
+ * myencode.h
+ *
+ * Encodes routes into a send queue (see mybatch.h) for a list of
+ * neighbors, with poisoned reverse: the copy that goes to a route's next
+ * hops says it is unreachable, so two neighbors never count to infinity
+ * through each other.  The daemon's sender thread and mybench both use
+ * it, so the benchmark times the encoding the daemon does.
+ */
+
+#ifndef MYENCODE_H
+#define MYENCODE_H
+
+#include <stdint.h>
+#include "mybatch.h"
+#include "mypacket.h"
+#include "mysnap.h"
+
+typedef struct {
+    txqueue__t *queue;
+    const uint32_t *neighbor_ids;  //node id of each destination in the send list, ascending
+    int num_neighbors;
+    size_t packet_size;
+    ripwriter__t w;                //the datagram being built, buf is NULL if none
+    int datagrams;                 //committed to the queue so far
+} encoder__t;
+
+void encode_begin(encoder__t *e, txqueue__t *queue, const uint32_t *neighbor_ids, int num_neighbors, size_t packet_size);
+void encode_route(encoder__t *e, uint32_t destination, uint32_t metric, uint32_t next_hop, const uint32_t *more_hops);
+int encode_snapshot(encoder__t *e, snapshot__t *snap);
+void encode_end(encoder__t *e);
+int cmp_id(const void *a, const void *b);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * myevent.c
+ *
+ * Event loop built on epoll.  It owns the sockets and the timers
+ * (each timer is a timerfd, see mytimer.h), so the cost of one loop
+ * iteration doesn't grow with the number of either.  It reads the clock
+ * once per wakeup, for callbacks that want the time without asking the
+ * kernel for it again.
+ */
+
+#include <sys/epoll.h>
+#include "myevent.h"
+#include "mymetrics.h"
+
+#define MAX_EVENTS 64
+
+typedef struct {
+    void (*callback)(void *);
+    void *arg;
+    mytimer_t *timer;    //non-NULL for timers
+} evsource__t;
+
+static void ev_register(evloop__t *loop, int fd, evsource__t *src)
+{
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        err_sys("  ev_register(): epoll_ctl() ERROR");
+    }
+}
+
+void ev_init(evloop__t *loop)
+{
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        err_sys("  ev_init(): epoll_create1() ERROR");
+    }
+    loop->idle = NULL;
+    loop->now = timer_now();
+}
+
+// Calls callback(arg) whenever fd is readable.
+void ev_add(evloop__t *loop, int fd, void (*callback)(void *), void *arg)
+{
+    evsource__t *src = calloc(1, sizeof(evsource__t));
+    if (!src) {
+        err_sys("  ev_add(): ERROR allocating memory!\n\n");
+    }
+    src->callback = callback;
+    src->arg = arg;
+    ev_register(loop, fd, src);
+}
+
+// The timer can be started and cleared as usual before or after this.
+// Its callback gets arg, whichever callback it is started with.
+void ev_add_timer(evloop__t *loop, mytimer_t *timer, void *arg)
+{
+    evsource__t *src = calloc(1, sizeof(evsource__t));
+    if (!src) {
+        err_sys("  ev_add_timer(): ERROR allocating memory!\n\n");
+    }
+    src->timer = timer;
+    timer->arg = arg;
+    ev_register(loop, timer_fd(timer), src);
+}
+
+// Runs forever.  Within one wakeup all sockets are serviced before any
+// timer fires, so a timer always sees the effect of the packets that
+// arrived with it.
+void ev_run(evloop__t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_quit("epoll_wait() < 0, strerror(errno) = %s\n", strerror(errno));
+        }
+
+        uint64_t start = metric_clock();
+        loop->now = start / 1000000;    //the same clock as timer_now()
+        for (int i = 0; i < n; i++) {
+            evsource__t *src = events[i].data.ptr;
+            if (!src->timer) src->callback(src->arg);
+        }
+        for (int i = 0; i < n; i++) {
+            evsource__t *src = events[i].data.ptr;
+            if (src->timer) timer_fire(src->timer, loop->now);
+        }
+
+        if (loop->idle) loop->idle();
+        metric_observe(HIST_LOOP, metric_clock() - start);
+    }
+}
@@ -0,0 +1,27 @@
+/*
+ * myevent.h
+ *
+ * Event loop built on epoll.  It owns the sockets and the timers
+ * (each timer is a timerfd, see mytimer.h), so the cost of one loop
+ * iteration doesn't grow with the number of either.  It reads the clock
+ * once per wakeup, for callbacks that want the time without asking the
+ * kernel for it again.
+ */
+
+#ifndef MYEVENT_H
+#define MYEVENT_H
+
+#include "mytimer.h"
+
+typedef struct {
+    int epfd;
+    void (*idle)();      //called after each batch of events, may be NULL
+    time_t now;          //timer_now() when the current batch of events came in
+} evloop__t;
+
+void ev_init(evloop__t *loop);
+void ev_add(evloop__t *loop, int fd, void (*callback)(void *), void *arg);
+void ev_add_timer(evloop__t *loop, mytimer_t *timer, void *arg);
+void ev_run(evloop__t *loop);
+
+#endif
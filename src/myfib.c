@@ -0,0 +1,335 @@
+/*
+ * myfib.c
+ *
+ * Installs the routing table in the kernel (the FIB) over rtnetlink.
+ * The route thread marks nodes whose next hops changed; a flush then
+ * writes the current state of each marked node, so a route that flapped
+ * several times since the last flush costs one message or none.  The
+ * messages of a flush go to the kernel a batch (FIB_BATCH bytes) per
+ * system call.
+ */
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "myfib.h"
+#include "mymetrics.h"
+
+#define FIB_PROTOCOL RTPROT_RIP
+#define FIB_MAX_MESSAGE 256     //one route message with TOPO_PATHS gateways fits
+
+static void fib_reserve(fib__t *fib, int num_nodes)
+{
+    int alloced = (fib->alloced == 0)?(1024):(fib->alloced);
+
+    if (num_nodes <= fib->alloced) return;
+    while (alloced < num_nodes) alloced *= 2;
+
+    if ((fib->installed = realloc(fib->installed, alloced * sizeof(fibentry__t))) == NULL) {
+        err_sys("  fib_reserve(): ERROR allocating memory!\n\n");
+    }
+    bzero(fib->installed + fib->alloced, (alloced - fib->alloced) * sizeof(fibentry__t));
+    fib->alloced = alloced;
+}
+
+// Reads the kernel's answers to what was sent so far.  Only failures
+// are answered, since nothing asks for acks.
+static void fib_drain(fib__t *fib)
+{
+    uint8_t buf[8192];
+    ssize_t n;
+
+    while ((n = recv(fib->fd, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            //ENOBUFS means answers were lost, which only happens to failures
+            if (errno == ENOBUFS) {
+                fib->errors++;
+                metric_add(METRIC_FIB_ERRORS, 1);
+                fib->first_error = (fib->first_error)?(fib->first_error):(ENOBUFS);
+                continue;
+            }
+            break;
+        }
+        for (struct nlmsghdr *h = (struct nlmsghdr *) buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+            struct nlmsgerr *err = NLMSG_DATA(h);
+            if (h->nlmsg_type != NLMSG_ERROR || err->error == 0) continue;
+
+            fib->errors++;
+            metric_add(METRIC_FIB_ERRORS, 1);
+            if (fib->first_error == 0) fib->first_error = -err->error;
+        }
+    }
+}
+
+static void fib_send(fib__t *fib)
+{
+    if (fib->len == 0) return;
+
+    while (send(fib->fd, fib->buf, fib->len, 0) < 0) {
+        if (errno == EINTR) continue;
+        printf("  fib_send(): send() error: %s\n", strerror(errno));
+        break;
+    }
+    metric_add(METRIC_FIB_BATCHES, 1);
+    fib->len = 0;
+    fib_drain(fib);
+}
+
+static void put_attr(struct nlmsghdr *h, int type, const void *data, int len)
+{
+    struct rtattr *rta = (struct rtattr *) ((uint8_t *) h + NLMSG_ALIGN(h->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    h->nlmsg_len = NLMSG_ALIGN(h->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+// Adds a message to the batch: RTM_NEWROUTE installs or replaces the
+// route to destination via gateways, RTM_DELROUTE removes ours.
+static void put_route(fib__t *fib, int type, uint32_t destination, const uint32_t *gateways)
+{
+    uint32_t dst = htonl(destination), table = fib->table;
+    struct nlmsghdr *h;
+    struct rtmsg *rtm;
+
+    if (fib->len + FIB_MAX_MESSAGE > FIB_BATCH) fib_send(fib);
+
+    h = (struct nlmsghdr *) (fib->buf + fib->len);
+    bzero(h, FIB_MAX_MESSAGE);
+    h->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    h->nlmsg_type = type;
+    h->nlmsg_flags = NLM_F_REQUEST | ((type == RTM_NEWROUTE)?(NLM_F_CREATE | NLM_F_REPLACE):(0));
+    h->nlmsg_seq = ++fib->seq;
+
+    rtm = NLMSG_DATA(h);
+    rtm->rtm_family = AF_INET;
+    rtm->rtm_dst_len = 32;
+    rtm->rtm_table = (fib->table < 256)?(fib->table):(RT_TABLE_UNSPEC);
+    rtm->rtm_protocol = FIB_PROTOCOL;
+    //a delete matches any scope and type, but only our protocol
+    rtm->rtm_scope = (type == RTM_NEWROUTE)?(RT_SCOPE_UNIVERSE):(RT_SCOPE_NOWHERE);
+    rtm->rtm_type = (type == RTM_NEWROUTE)?(RTN_UNICAST):(RTN_UNSPEC);
+    put_attr(h, RTA_DST, &dst, sizeof(dst));
+    put_attr(h, RTA_TABLE, &table, sizeof(table));
+
+    if (type == RTM_NEWROUTE && gateways[1] == 0) {
+        put_attr(h, RTA_GATEWAY, &gateways[0], sizeof(uint32_t));
+    } else if (type == RTM_NEWROUTE) {
+        struct rtattr *mp = (struct rtattr *) ((uint8_t *) h + h->nlmsg_len);
+        mp->rta_type = RTA_MULTIPATH;
+        h->nlmsg_len += RTA_LENGTH(0);
+
+        for (int i = 0; i < TOPO_PATHS && gateways[i] != 0; i++) {
+            struct rtnexthop *nh = (struct rtnexthop *) ((uint8_t *) h + h->nlmsg_len);
+            struct rtattr *gw = RTNH_DATA(nh);
+
+            nh->rtnh_len = RTNH_LENGTH(RTA_SPACE(sizeof(uint32_t)));
+            gw->rta_type = RTA_GATEWAY;
+            gw->rta_len = RTA_LENGTH(sizeof(uint32_t));
+            memcpy(RTA_DATA(gw), &gateways[i], sizeof(uint32_t));
+            h->nlmsg_len += RTNH_ALIGN(nh->rtnh_len);
+        }
+        mp->rta_len = (uint8_t *) h + h->nlmsg_len - (uint8_t *) mp;
+    }
+
+    fib->len += NLMSG_ALIGN(h->nlmsg_len);
+    metric_add(METRIC_FIB_WRITES, 1);
+}
+
+// Lists the routes of ours the kernel already has in fib->table, from a
+// run that didn't clean up after itself.
+static void fib_dump(fib__t *fib)
+{
+    struct {
+        struct nlmsghdr h;
+        struct rtmsg r;
+    } req;
+    int alloced = 0, done = 0;
+
+    bzero(&req, sizeof(req));
+    req.h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.h.nlmsg_type = RTM_GETROUTE;
+    req.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.h.nlmsg_seq = ++fib->seq;
+    req.r.rtm_family = AF_INET;
+    if (send(fib->fd, &req, req.h.nlmsg_len, 0) < 0) {
+        err_sys("  fib_dump(): send() ERROR");
+    }
+
+    while (!done) {
+        ssize_t n = recv(fib->fd, fib->buf, FIB_BATCH, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_sys("  fib_dump(): recv() ERROR");
+        }
+
+        for (struct nlmsghdr *h = (struct nlmsghdr *) fib->buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+            if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR) {
+                done = 1;
+                break;
+            }
+            if (h->nlmsg_type != RTM_NEWROUTE) continue;
+
+            struct rtmsg *rtm = NLMSG_DATA(h);
+            uint32_t table = rtm->rtm_table, dst = 0;
+            int len = RTM_PAYLOAD(h);
+
+            if (rtm->rtm_protocol != FIB_PROTOCOL || rtm->rtm_dst_len != 32) continue;
+            for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+                if (rta->rta_type == RTA_TABLE) memcpy(&table, RTA_DATA(rta), sizeof(table));
+                if (rta->rta_type == RTA_DST) memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+            }
+            if (table != (uint32_t) fib->table || dst == 0) continue;
+
+            if (fib->num_leftover >= alloced) {
+                alloced = (alloced == 0)?(64):(alloced * 2);
+                if ((fib->leftover = realloc(fib->leftover, alloced * sizeof(uint32_t))) == NULL) {
+                    err_sys("  fib_dump(): ERROR allocating memory!\n\n");
+                }
+            }
+            fib->leftover[fib->num_leftover++] = ntohl(dst);
+        }
+    }
+}
+
+// Opens the netlink socket and finds routes left over from an earlier
+// run.  table is the kernel routing table to use.
+void fib_open(fib__t *fib, int table, int verbose)
+{
+    struct sockaddr_nl addr;
+
+    bzero(fib, sizeof(*fib));
+    fib->table = table;
+    fib->verbose = verbose;
+    if ((fib->buf = malloc(FIB_BATCH)) == NULL) {
+        err_sys("  fib_open(): ERROR allocating memory!\n\n");
+    }
+
+    if ((fib->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        err_sys("  fib_open(): socket() ERROR");
+    }
+    bzero(&addr, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(fib->fd, (SA *) &addr, sizeof(addr)) < 0) {
+        err_sys("  fib_open(): bind() ERROR");
+    }
+
+    fib_dump(fib);
+    if (verbose) printf("  fib_open(): %d routes left from before in table %d\n", fib->num_leftover, table);
+}
+
+// Call this whenever node's next hops change, or it goes away.
+void fib_changed(fib__t *fib, node__t *node)
+{
+    fib_reserve(fib, node->index + 1);
+    if (fib->installed[node->index].pending) return;
+
+    if (fib->num_pending >= fib->pending_alloced) {
+        fib->pending_alloced = (fib->pending_alloced == 0)?(1024):(fib->pending_alloced * 2);
+        if ((fib->pending = realloc(fib->pending, fib->pending_alloced * sizeof(uint32_t))) == NULL) {
+            err_sys("  fib_changed(): ERROR allocating memory!\n\n");
+        }
+    }
+    fib->installed[node->index].pending = 1;
+    fib->pending[fib->num_pending++] = node->index;
+}
+
+// Marks every node, so the next flush writes the whole table.
+void fib_resync(fib__t *fib, topo__t *topo)
+{
+    fib_reserve(fib, topo->used);
+    for (int i = 0; i < topo->used; i++) {
+        if (topo_node(topo, i)->destination != 0) fib_changed(fib, topo_node(topo, i));
+    }
+}
+
+// The addresses of node's next hops, sorted so two sets compare with memcmp().
+static void node_gateways(topo__t *topo, node__t *node, uint32_t *gateways)
+{
+    int count = 0;
+
+    bzero(gateways, TOPO_PATHS * sizeof(uint32_t));
+    for (int i = 0; i < TOPO_PATHS; i++) {
+        uint32_t hop = (i == 0)?(node->next_hop):(node->more_hops[i - 1]);
+        node__t *neighbor;
+        uint32_t gw;
+        int j;
+
+        if (hop == 0) break;
+        if ((neighbor = topo_find(topo, hop)) == NULL) continue;
+        gw = neighbor->destaddr.sin_addr.s_addr;
+
+        for (j = count; j > 0 && gateways[j - 1] > gw; j--);
+        if (j > 0 && gateways[j - 1] == gw) continue;    //two neighbors on one host
+        memmove(&gateways[j + 1], &gateways[j], (count - j) * sizeof(uint32_t));
+        gateways[j] = gw;
+        count++;
+    }
+}
+
+// Brings the kernel up to date with every marked node.  Returns the
+// number of route messages that took.
+int fib_flush(fib__t *fib, topo__t *topo, node__t *self)
+{
+    int writes = 0;
+
+    fib->errors = fib->first_error = 0;
+    for (int p = 0; p < fib->num_pending; p++) {
+        uint32_t index = fib->pending[p], gateways[TOPO_PATHS];
+        fibentry__t *e = &fib->installed[index];
+        node__t *node = topo_node(topo, index);
+
+        e->pending = 0;
+        if (node->destination != 0 && node != self && node->next_hop != 0) {
+            node_gateways(topo, node, gateways);
+        } else {
+            gateways[0] = 0;
+        }
+
+        //the slot may hold a different destination than the one installed
+        if (e->destination != 0 && (e->destination != node->destination || gateways[0] == 0)) {
+            put_route(fib, RTM_DELROUTE, e->destination, NULL);
+            e->destination = 0;
+            writes++;
+        }
+        if (gateways[0] != 0 && (e->destination == 0 || memcmp(gateways, e->gateways, sizeof(gateways)) != 0)) {
+            put_route(fib, RTM_NEWROUTE, node->destination, gateways);
+            e->destination = node->destination;
+            memcpy(e->gateways, gateways, sizeof(gateways));
+            writes++;
+        }
+    }
+    fib->num_pending = 0;
+
+    //whatever is left from before and wasn't just replaced goes
+    for (int i = 0; i < fib->num_leftover; i++) {
+        node__t *node = topo_find(topo, fib->leftover[i]);
+        if (!node || fib->installed[node->index].destination != fib->leftover[i]) {
+            put_route(fib, RTM_DELROUTE, fib->leftover[i], NULL);
+            writes++;
+        }
+    }
+    free(fib->leftover);
+    fib->leftover = NULL;
+    fib->num_leftover = 0;
+
+    fib_send(fib);
+    if (fib->errors) {
+        printf("  fib_flush(): %d of %d route changes failed, the first with: %s\n",
+               fib->errors, writes, strerror(fib->first_error));
+    } else if (fib->verbose && writes) {
+        printf("  fib_flush(): %d route changes\n", writes);
+    }
+    return writes;
+}
+
+void fib_close(fib__t *fib)
+{
+    close(fib->fd);
+    free(fib->installed);
+    free(fib->pending);
+    free(fib->leftover);
+    free(fib->buf);
+    bzero(fib, sizeof(*fib));
+}
@@ -0,0 +1,56 @@
+/*
+ * myfib.h
+ *
+ * Installs the routing table in the kernel (the FIB) over rtnetlink.
+ * The route thread marks nodes whose next hops changed; a flush then
+ * writes the current state of each marked node, so a route that flapped
+ * several times since the last flush costs one message or none.  The
+ * messages of a flush go to the kernel a batch (FIB_BATCH bytes) per
+ * system call.
+ *
+ * Each destination id is installed as a /32 route to the id read as an
+ * IPv4 address, the way ids travel in packets (mypacket.h), via the IP
+ * addresses of its next hops (a multipath route when there are several).
+ * Routes are tagged with protocol RTPROT_RIP, and any that are left in
+ * the table from an earlier run are replaced or deleted by the first
+ * flush.
+ */
+
+#ifndef MYFIB_H
+#define MYFIB_H
+
+#include "mytopo.h"
+
+#define FIB_BATCH 32768         //bytes of netlink messages per send()
+
+typedef struct {
+    uint32_t destination;       //0 = nothing installed for this node index
+    uint32_t gateways[TOPO_PATHS];  //network byte order, sorted, 0 = unused
+    uint8_t pending;            //in fib->pending
+} fibentry__t;
+
+typedef struct {
+    int fd;
+    int table;                  //kernel routing table id, 254 = main
+    int verbose;
+    uint32_t seq;
+    fibentry__t *installed;     //by node index
+    int alloced;
+    uint32_t *pending;          //node indexes waiting for a flush
+    int num_pending;
+    int pending_alloced;
+    uint32_t *leftover;         //our routes found at startup
+    int num_leftover;
+    uint8_t *buf;               //the batch being built
+    size_t len;
+    int errors;                 //failures reported for the last flush
+    int first_error;
+} fib__t;
+
+void fib_open(fib__t *fib, int table, int verbose);
+void fib_changed(fib__t *fib, node__t *node);
+void fib_resync(fib__t *fib, topo__t *topo);
+int fib_flush(fib__t *fib, topo__t *topo, node__t *self);
+void fib_close(fib__t *fib);
+
+#endif
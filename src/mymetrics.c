@@ -0,0 +1,225 @@
+/*
+ * mymetrics.c
+ *
+ * Counters and latency histograms.  Every thread that records anything
+ * registers once and then only ever writes its own block, so recording
+ * is a plain store with no locks and no shared cache lines.  A reader
+ * can render all the blocks at any time in the Prometheus text format,
+ * one series per thread.
+ */
+
+#include <poll.h>
+#include <sys/un.h>
+#include "mymetrics.h"
+
+#define REQUEST_WAIT 100    //milliseconds to wait for an HTTP request line
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metric_info[METRICS] = {
+    {"rip_rx_datagrams_total", "counter", "Datagrams received."},
+    {"rip_rx_bytes_total", "counter", "Bytes received in datagrams."},
+    {"rip_rx_malformed_total", "counter", "Datagrams dropped as truncated or not RIP."},
+    {"rip_rx_not_neighbor_total", "counter", "Packets ignored because the sender is not a neighbor."},
+    {"rip_rx_requests_total", "counter", "RIP requests ignored."},
+    {"rip_rx_entries_total", "counter", "Route entries processed by update_routes()."},
+    {"rip_rx_kernel_drops_total", "counter", "Datagrams the kernel dropped because the socket buffer was full."},
+    {"rip_rx_coalesced_total", "counter", "Route entries skipped because a newer update from the same neighbor replaced them."},
+    {"rip_rx_deferred_total", "counter", "Times the route thread left received datagrams for its next wakeup."},
+    {"rip_rx_shed_total", "counter", "Datagrams dropped because their sender had more than its share of a full receive ring."},
+    {"rip_tx_datagrams_total", "counter", "Datagrams sent, one per neighbor."},
+    {"rip_tx_bytes_total", "counter", "Bytes sent in datagrams."},
+    {"rip_tx_errors_total", "counter", "Datagrams that could not be sent."},
+    {"rip_full_updates_total", "counter", "Full table dumps sent."},
+    {"rip_triggered_updates_total", "counter", "Triggered updates sent."},
+    {"rip_route_changes_total", "counter", "Routes whose metric changed or that became valid."},
+    {"rip_routes_lost_total", "counter", "Valid routes that became unreachable."},
+    {"rip_routes_expired_total", "counter", "Routes that timed out."},
+    {"rip_routes", "gauge", "Routes in the table."},
+    {"rip_fib_writes_total", "counter", "Route additions, changes and deletions sent to the kernel."},
+    {"rip_fib_batches_total", "counter", "Netlink send() calls the route messages took."},
+    {"rip_fib_errors_total", "counter", "Route messages the kernel refused."},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} hist_info[HISTS] = {
+    {"rip_update_seconds", "Time update_routes() took per packet."},
+    {"rip_timer_lateness_seconds", "How long after its alarm a timer fired."},
+    {"rip_loop_seconds", "Time spent handling one event loop wakeup."},
+};
+
+//threads that never registered share this one, it isn't rendered
+static metrics__t unregistered;
+static __thread metrics__t *local = &unregistered;
+static metrics__t *head = NULL;
+
+static void store(uint64_t *p, uint64_t value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+// Gives the calling thread its own block, labelled name.  Call it once
+// at the top of the thread.
+void metrics_thread(const char *name)
+{
+    metrics__t *m = calloc(1, sizeof(metrics__t));
+    if (!m) {
+        err_sys("  metrics_thread(): ERROR allocating memory!\n\n");
+    }
+    snprintf(m->name, sizeof(m->name), "%s", name);
+
+    m->next = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&head, &m->next, m, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    local = m;
+}
+
+// Only the owning thread writes its block, so no read-modify-write is needed.
+void metric_add(int metric, uint64_t n)
+{
+    store(&local->values[metric], local->values[metric] + n);
+}
+
+void metric_set(int metric, uint64_t value)
+{
+    store(&local->values[metric], value);
+}
+
+void metric_observe(int hist, uint64_t ns)
+{
+    metrichist__t *h = &local->hists[hist];
+    uint64_t us = (ns + 999) / 1000;  //rounded up, a bucket holds what's <= its bound
+    int bucket = (us <= 1)?(0):(64 - __builtin_clzll(us - 1));
+
+    if (bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+    store(&h->count[bucket], h->count[bucket] + 1);
+    store(&h->sum_ns, h->sum_ns + ns);
+    store(&h->total, h->total + 1);
+}
+
+// Nanoseconds on the monotonic clock, for timing things to observe.
+uint64_t metric_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Writes every registered thread's values.  Series a thread never
+// touched are left out.
+void metrics_render(FILE *out)
+{
+    metrics__t *first = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < METRICS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric_info[i].name, metric_info[i].help,
+                metric_info[i].name, metric_info[i].type);
+        for (metrics__t *m = first; m; m = m->next) {
+            uint64_t value = load(&m->values[i]);
+            if (value == 0) continue;
+            fprintf(out, "%s{thread=\"%s\"} %llu\n", metric_info[i].name, m->name, (unsigned long long) value);
+        }
+    }
+
+    for (int i = 0; i < HISTS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", hist_info[i].name, hist_info[i].help, hist_info[i].name);
+        for (metrics__t *m = first; m; m = m->next) {
+            metrichist__t *h = &m->hists[i];
+            uint64_t cumulative = 0;
+
+            if (load(&h->total) == 0) continue;
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                cumulative += load(&h->count[b]);
+                if (b < HIST_BUCKETS - 1) {
+                    fprintf(out, "%s_bucket{thread=\"%s\",le=\"%g\"} %llu\n", hist_info[i].name, m->name,
+                            (double) (1ULL << b) / 1e6, (unsigned long long) cumulative);
+                } else {
+                    fprintf(out, "%s_bucket{thread=\"%s\",le=\"+Inf\"} %llu\n", hist_info[i].name, m->name,
+                            (unsigned long long) cumulative);
+                }
+            }
+            //sum and count may be a hair ahead of the buckets, they're read later
+            fprintf(out, "%s_sum{thread=\"%s\"} %.9f\n", hist_info[i].name, m->name, load(&h->sum_ns) / 1e9);
+            fprintf(out, "%s_count{thread=\"%s\"} %llu\n", hist_info[i].name, m->name,
+                    (unsigned long long) load(&h->total));
+        }
+    }
+}
+
+// Returns a listening Unix domain socket at path, replacing whatever
+// was there.
+int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err_quit("  metrics_listen(): path too long: %s\n", path);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    fd = Socket(AF_UNIX, SOCK_STREAM, 0);
+    Bind(fd, (SA *) &addr, sizeof(addr));
+    Listen(fd, 8);
+    return fd;
+}
+
+// Thread body, arg is the socket from metrics_listen() cast to intptr_t.
+// Every connection gets one rendering and is closed.  Clients that send
+// an HTTP request (curl --unix-socket) get an HTTP response; ones that
+// send nothing (socat, nc -U) get the bare text.
+void *metrics_server(void *arg)
+{
+    int listenfd = (intptr_t) arg;
+
+    metrics_thread("metrics");
+    for (;;) {
+        char request[512], *text = NULL;
+        size_t len = 0;
+        int connfd, http = 0;
+
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+            if (errno != EINTR) printf("  metrics_server(): accept() error: %s\n", strerror(errno));
+            continue;
+        }
+
+        struct pollfd pfd = {connfd, POLLIN, 0};
+        if (poll(&pfd, 1, REQUEST_WAIT) > 0) {
+            ssize_t n = recv(connfd, request, sizeof(request) - 1, MSG_DONTWAIT);
+            http = (n >= 4 && strncmp(request, "GET ", 4) == 0);
+        }
+
+        FILE *out = open_memstream(&text, &len);
+        if (out) {
+            metrics_render(out);
+            fclose(out);
+        }
+
+        if (http) {
+            char header[128];
+            int n = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+            send(connfd, header, n, MSG_NOSIGNAL);
+        }
+        for (size_t off = 0; off < len; ) {
+            ssize_t n = send(connfd, text + off, len - off, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            off += n;
+        }
+
+        free(text);
+        close(connfd);
+    }
+    return NULL;
+}
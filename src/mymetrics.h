@@ -0,0 +1,70 @@
+/*
+ * mymetrics.h
+ *
+ * Counters and latency histograms.  Every thread that records anything
+ * registers once and then only ever writes its own block, so recording
+ * is a plain store with no locks and no shared cache lines.  A reader
+ * can render all the blocks at any time in the Prometheus text format,
+ * one series per thread.
+ */
+
+#ifndef MYMETRICS_H
+#define MYMETRICS_H
+
+#include <stdint.h>
+#include "myunp.h"
+
+#define METRIC_RX_DATAGRAMS 0      //received, including the ones dropped later
+#define METRIC_RX_BYTES 1
+#define METRIC_RX_MALFORMED 2      //truncated or not a RIP packet
+#define METRIC_RX_NOT_NEIGHBOR 3
+#define METRIC_RX_REQUESTS 4       //RIP requests, which we ignore
+#define METRIC_RX_ENTRIES 5        //route entries run through update_routes()
+#define METRIC_RX_KERNEL_DROPS 6   //dropped by the kernel, socket buffer full
+#define METRIC_RX_COALESCED 7      //entries skipped, a newer update replaced them
+#define METRIC_RX_DEFERRED 8       //times the route thread left a backlog for later
+#define METRIC_RX_SHED 9           //dropped by a worker, the sender had more than its share waiting
+#define METRIC_TX_DATAGRAMS 10     //one per neighbor
+#define METRIC_TX_BYTES 11
+#define METRIC_TX_ERRORS 12
+#define METRIC_FULL_UPDATES 13
+#define METRIC_TRIGGERED_UPDATES 14
+#define METRIC_ROUTE_CHANGES 15    //metric changed or route became valid
+#define METRIC_ROUTES_LOST 16      //valid routes that became unreachable
+#define METRIC_ROUTES_EXPIRED 17   //of those, the ones that timed out
+#define METRIC_ROUTES 18           //gauge, routes in the table
+#define METRIC_FIB_WRITES 19       //route messages sent to the kernel
+#define METRIC_FIB_BATCHES 20      //send() calls they took
+#define METRIC_FIB_ERRORS 21       //route messages the kernel refused
+#define METRICS 22
+
+#define HIST_UPDATE 0              //update_routes() per packet
+#define HIST_TIMER_LATE 1          //how long after its alarm a timer fired
+#define HIST_LOOP 2                //one event loop wakeup
+#define HISTS 3
+
+#define HIST_BUCKETS 24            //1us, 2us, 4us ... 4s, +Inf
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t total;
+} metrichist__t;
+
+typedef struct metrics {
+    char name[16];                 //the thread label
+    uint64_t values[METRICS];
+    metrichist__t hists[HISTS];
+    struct metrics *next;
+} metrics__t;
+
+void metrics_thread(const char *name);
+void metric_add(int metric, uint64_t n);
+void metric_set(int metric, uint64_t value);
+void metric_observe(int hist, uint64_t ns);
+uint64_t metric_clock();
+void metrics_render(FILE *out);
+int metrics_listen(const char *path);
+void *metrics_server(void *arg);
+
+#endif
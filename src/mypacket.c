@@ -0,0 +1,206 @@
+/*
+ * mypacket.c
+ *
+ * RIPv2 (RFC 2453) packet encoder and decoder.  Everything on the wire
+ * is in network byte order.  The writer serializes straight into the
+ * caller's send buffer and the reader walks entries in place in the
+ * receive buffer, so neither one allocates or copies the packet.
+ */
+
+#include "mypacket.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RIP_SIMD 1
+#endif
+
+//the buffers carry no alignment guarantee, so go byte by byte
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t) p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// Starts a packet at the front of buf.  size must be at least RIP_HEADER_SIZE.
+void rip_writer_init(ripwriter__t *w, void *buf, size_t size, uint8_t command)
+{
+    w->buf = buf;
+    w->size = size;
+    w->num_entries = 0;
+
+    w->buf[0] = command;
+    w->buf[1] = RIP_VERSION;
+    put16(w->buf + 2, 0);
+    w->len = RIP_HEADER_SIZE;
+}
+
+// Appends one route.  Returns 0 if the buffer is full, 1 otherwise.
+int rip_put_entry(ripwriter__t *w, uint32_t destination, uint32_t metric)
+{
+    if (w->len + RIP_ENTRY_SIZE > w->size) return 0;
+
+    uint8_t *p = w->buf + w->len;
+    put16(p, RIP_AF_INET);
+    put16(p + 2, 0);                  //route tag
+    put32(p + 4, destination);
+    put32(p + 8, 0xffffffff);         //host route
+    put32(p + 12, 0);                 //next hop = the sender
+    put32(p + RIP_METRIC_OFFSET, (metric > RIP_INFINITY)?(RIP_INFINITY):(metric));
+
+    w->len += RIP_ENTRY_SIZE;
+    w->num_entries++;
+    return 1;
+}
+
+static int put_entries_scalar(ripwriter__t *w, const uint32_t *destinations, const uint32_t *metrics, int count)
+{
+    int i;
+    for (i = 0; i < count && rip_put_entry(w, destinations[i], metrics[i]); i++) ;
+    return i;
+}
+
+#ifdef RIP_SIMD
+// Four entries are 80 bytes, five vectors.  Each vector is built from
+// the words every entry has, with the destinations and metrics that land
+// in it blended in from the byte-swapped input.
+__attribute__((target("sse4.1")))
+static int put_entries_sse(ripwriter__t *w, const uint32_t *destinations, const uint32_t *metrics, int count)
+{
+    int room = (w->size - w->len) / RIP_ENTRY_SIZE;
+    int n = (count < room)?(count):(room);
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i infinity = _mm_set1_epi32(RIP_INFINITY);
+    const int family = htonl(RIP_AF_INET << 16);    //and a route tag of 0
+    const __m128i fixed0 = _mm_setr_epi32(family, 0, -1, 0);
+    const __m128i fixed1 = _mm_setr_epi32(0, family, 0, -1);
+    const __m128i fixed2 = _mm_setr_epi32(0, 0, family, 0);
+    const __m128i fixed3 = _mm_setr_epi32(-1, 0, 0, family);
+    const __m128i fixed4 = _mm_setr_epi32(0, -1, 0, 0);
+    uint8_t *p = w->buf + w->len;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4, p += 4 * RIP_ENTRY_SIZE) {
+        __m128i d = _mm_loadu_si128((const __m128i *) (destinations + i));
+        __m128i m = _mm_loadu_si128((const __m128i *) (metrics + i));
+        d = _mm_shuffle_epi8(d, swap);
+        m = _mm_shuffle_epi8(_mm_min_epu32(m, infinity), swap);
+
+        //blend masks pick 16-bit words, 0x03 << 2k is dword k
+        __m128i v0 = _mm_blend_epi16(fixed0, _mm_shuffle_epi32(d, 0x00), 0x0c);
+        __m128i v1 = _mm_blend_epi16(fixed1, _mm_shuffle_epi32(m, 0x00), 0x03);
+        v1 = _mm_blend_epi16(v1, _mm_shuffle_epi32(d, 0x55), 0x30);
+        __m128i v2 = _mm_blend_epi16(fixed2, _mm_shuffle_epi32(m, 0x55), 0x0c);
+        v2 = _mm_blend_epi16(v2, _mm_shuffle_epi32(d, 0xaa), 0xc0);
+        __m128i v3 = _mm_blend_epi16(fixed3, _mm_shuffle_epi32(m, 0xaa), 0x30);
+        __m128i v4 = _mm_blend_epi16(fixed4, _mm_shuffle_epi32(d, 0xff), 0x03);
+        v4 = _mm_blend_epi16(v4, _mm_shuffle_epi32(m, 0xff), 0xc0);
+
+        _mm_storeu_si128((__m128i *) p, v0);
+        _mm_storeu_si128((__m128i *) (p + 16), v1);
+        _mm_storeu_si128((__m128i *) (p + 32), v2);
+        _mm_storeu_si128((__m128i *) (p + 48), v3);
+        _mm_storeu_si128((__m128i *) (p + 64), v4);
+    }
+    w->len += i * RIP_ENTRY_SIZE;
+    w->num_entries += i;
+
+    return i + put_entries_scalar(w, destinations + i, metrics + i, n - i);
+}
+#endif
+
+// Appends as many of count routes as fit, destinations[i] with
+// metrics[i].  Returns how many it added.  Entry i starts at the packet
+// length from before the call plus i * RIP_ENTRY_SIZE.  Uses SSE4.1
+// where the CPU has it, one entry at a time otherwise.
+int rip_put_entries(ripwriter__t *w, const uint32_t *destinations, const uint32_t *metrics, int count)
+{
+#ifdef RIP_SIMD
+    if (__builtin_cpu_supports("sse4.1")) {
+        return put_entries_sse(w, destinations, metrics, count);
+    }
+#endif
+    return put_entries_scalar(w, destinations, metrics, count);
+}
+
+// Where in the packet the metric of the entry just added is, so a copy
+// of the packet can be patched for one destination (poisoned reverse).
+size_t rip_last_metric(ripwriter__t *w)
+{
+    return w->len - RIP_ENTRY_SIZE + RIP_METRIC_OFFSET;
+}
+
+// Checks the header and that len holds a whole number of entries.
+// Returns the number of entries, or -1 if the packet is malformed.
+int rip_reader_init(ripreader__t *r, const void *buf, size_t len)
+{
+    r->buf = buf;
+    r->len = len;
+    r->off = RIP_HEADER_SIZE;
+    r->num_entries = 0;
+
+    if (len < RIP_HEADER_SIZE) return -1;
+
+    r->command = r->buf[0];
+    if (r->command != RIP_REQUEST && r->command != RIP_RESPONSE) return -1;
+    //RFC 2453 4.1, ignore versions we don't know but accept v1 and v2
+    if (r->buf[1] != 1 && r->buf[1] != RIP_VERSION) return -1;
+    if ((len - RIP_HEADER_SIZE) % RIP_ENTRY_SIZE != 0) return -1;
+
+    r->num_entries = (len - RIP_HEADER_SIZE) / RIP_ENTRY_SIZE;
+    return r->num_entries;
+}
+
+// Reads the next usable entry.  Entries that aren't IPv4 routes
+// (authentication, other families) or have a metric past infinity are
+// skipped, as RFC 2453 3.9.2 asks.  A metric of 0 is accepted because
+// nodes advertise themselves at distance 0.  Returns 0 at the end.
+int rip_next_entry(ripreader__t *r, ripentry__t *entry)
+{
+    while (r->off + RIP_ENTRY_SIZE <= r->len) {
+        const uint8_t *p = r->buf + r->off;
+        r->off += RIP_ENTRY_SIZE;
+
+        if (get16(p) != RIP_AF_INET) continue;
+        entry->destination = get32(p + 4);
+        entry->metric = get32(p + 16);
+        if (entry->metric > RIP_INFINITY) continue;
+        return 1;
+    }
+    return 0;
+}
+
+// Makes the entry at offset in a received packet one that readers skip,
+// e.g. because a newer packet says the same thing.
+void rip_clear_entry(void *buf, size_t offset)
+{
+    put16((uint8_t *) buf + offset, 0);
+}
+
+// The longest packet of whole entries that fits in one IPv4 datagram on a
+// link with this MTU, but always room for at least one entry.
+size_t rip_packet_size(int mtu)
+{
+    if (mtu > 65535) mtu = 65535;
+
+    long len = mtu - IP_UDP_HEADERS;
+    if (len < RIP_HEADER_SIZE + RIP_ENTRY_SIZE) return RIP_HEADER_SIZE + RIP_ENTRY_SIZE;
+    return len - (len - RIP_HEADER_SIZE) % RIP_ENTRY_SIZE;
+}
@@ -0,0 +1,62 @@
+/*
+ * mypacket.h
+ *
+ * RIPv2 (RFC 2453) packet encoder and decoder.  Everything on the wire
+ * is in network byte order.  The writer serializes straight into the
+ * caller's send buffer and the reader walks entries in place in the
+ * receive buffer, so neither one allocates or copies the packet.
+ *
+ * Node ids travel in the IPv4 address field of each entry, with a
+ * host (/32) mask and a 0.0.0.0 next hop ("via the sender").
+ *
+ *   header:  command(1) version(1) zero(2)
+ *   entry:   family(2) route tag(2) address(4) mask(4) next hop(4) metric(4)
+ */
+
+#ifndef MYPACKET_H
+#define MYPACKET_H
+
+#include "myunp.h"
+
+#define RIP_HEADER_SIZE 4
+#define RIP_ENTRY_SIZE 20
+#define RIP_METRIC_OFFSET 16  //of the metric within an entry
+#define RIP_REQUEST 1
+#define RIP_RESPONSE 2
+#define RIP_VERSION 2
+#define RIP_AF_INET 2
+#define RIP_INFINITY 16
+#define RIP_MAX_ENTRIES 25    //per datagram, RFC 2453 3.6
+#define RIP_MAX_PACKET (RIP_HEADER_SIZE + RIP_MAX_ENTRIES * RIP_ENTRY_SIZE)
+#define IP_UDP_HEADERS 28
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;          //capacity of buf
+    size_t len;           //bytes written so far
+    int num_entries;
+} ripwriter__t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;           //bytes received
+    size_t off;           //next entry
+    uint8_t command;
+    int num_entries;
+} ripreader__t;
+
+typedef struct {
+    uint32_t destination;
+    uint32_t metric;
+} ripentry__t;
+
+void rip_writer_init(ripwriter__t *w, void *buf, size_t size, uint8_t command);
+int rip_put_entry(ripwriter__t *w, uint32_t destination, uint32_t metric);
+int rip_put_entries(ripwriter__t *w, const uint32_t *destinations, const uint32_t *metrics, int count);
+size_t rip_last_metric(ripwriter__t *w);
+int rip_reader_init(ripreader__t *r, const void *buf, size_t len);
+int rip_next_entry(ripreader__t *r, ripentry__t *entry);
+void rip_clear_entry(void *buf, size_t offset);
+size_t rip_packet_size(int mtu);
+
+#endif
@@ -1,499 +1,1307 @@
 /*
  * Daniel Farley - dfarley@ucsc.edu
- * Usage: ./myrip <node.config> <neightbor.config> <local_port>
+ * Usage: ./myrip [-u update_interval] [-m mtu] [-n max_routes] [-p print_interval] [-c] [-i interface]... [-w workers] [-q queue_depth] [-B rcvbuf] [-S metrics_socket] [-F table] [-R state_file] [-v] <node.config> <neightbor.config> <local_port>... | all
+ *
+ *   -u  seconds between full table dumps (default 10), fractions like 0.5
+ *       allowed.  Routes expire after 4x this and are garbage collected 3x
+ *       this later.  0 disables full dumps and expiry, leaving only
+ *       triggered updates.
+ *   -m  link MTU in bytes.  Updates are split into datagrams that fit it
+ *       instead of the RFC 2453 limit of 25 routes per datagram.
+ *   -n  most destinations to keep, including the ones in node.config
+ *       (default 100000).  Routes to destinations that aren't in node.config
+ *       are learned from updates until the table is this big.
+ *   -p  print the table at most once every this many seconds while it is
+ *       changing (default 1).  0 prints it only when asked with SIGUSR1,
+ *       which works with any setting.
+ *   -c  print the table in the compact format (see mystatus.h)
+ *   -i  listen on this interface only, with a socket of its own; give it
+ *       once per interface.  Updates go to each neighbor through the
+ *       socket of the interface whose subnet it is on.
+ *   -w  receive with this many worker threads (default 1, 0 = one per
+ *       core, but no more than the -q buffers can give RECV_BATCH each),
+ *       see below
+ *   -q  datagrams that can wait for the route thread (default 128,
+ *       rounded up to a power of two), split between the workers, but
+ *       never fewer than RECV_BATCH per worker.  Each takes a 64 KB
+ *       buffer.  See below for what happens when it fills.
+ *   -B  ask for a kernel receive buffer of this many bytes per socket
+ *       (default: the system's).  More than net.core.rmem_max needs
+ *       CAP_NET_ADMIN; what the kernel actually gave is printed.
+ *   -F  install the routes in this kernel routing table (254 is main),
+ *       see myfib.h.  Needs CAP_NET_ADMIN.
+ *   -R  save the table to this file every few seconds and, at startup,
+ *       restore it from there, see mystate.h
+ *   -S  serve counters and latency histograms in the Prometheus text
+ *       format on a Unix domain socket at this path, e.g.
+ *       curl --unix-socket <path> http://localhost/metrics
+ *   -v  log every packet and route change
+ *
+ * One process can run several nodes: give more than one local port, or
+ * all for every node in node.config.  Each node (an instance__t) has its
+ * own sockets, table, timers and send queue, and they share the threads
+ * below.  -R then saves each node's table to <state_file>.<node id>, and
+ * -F only works with one node.
+ *
+ * SIGHUP reads both config files again and applies what changed to the
+ * running tables (see reload_config()), keeping the routes they have
+ * learned.  If either file has errors, the current configuration stays.
+ *
+ * Threads: the receive workers read datagrams, check their headers and
+ * queue them in their own rings.  With -w each node has a socket per
+ * worker (per interface), bound to the same port with SO_REUSEPORT; the
+ * kernel hashes the sender's address to pick one, so all of a neighbor's
+ * updates go to the same worker and stay in order.  The route thread
+ * (main) drains every worker's ring and is the only one that touches the
+ * tables and the route timers, so it walks every entry itself and more
+ * workers only take the system calls off it.  It publishes read-only
+ * snapshots of the tables for the sender thread, which encodes and paces
+ * out updates, and the status thread (mystatus.c), which prints the
+ * tables.  With -S the metrics thread (mymetrics.c) answers on the
+ * metrics socket, and with -R the state thread saves snapshots to the
+ * state files.
+ *
+ * Overload: the route thread takes at most RECV_BUDGET datagrams from a
+ * ring per wakeup, so timers keep firing on time and every worker's ring
+ * gets its turn however busy the others are.  While a ring has more than
+ * that waiting, a newer update from a neighbor replaces the entries for
+ * the same destinations in its older ones still in the ring (see
+ * mycoalesce.h), so a flood costs one entry per destination.  When a
+ * ring is nearly full the worker sheds datagrams from whoever has more
+ * than their share waiting (rip_rx_shed_total), so one neighbor can't
+ * fill it and the others still get in.  A ring full of fair shares
+ * holds the worker back, and then the socket buffer fills and the
+ * kernel drops datagrams; they are counted (rip_rx_kernel_drops_total)
+ * rather than lost silently.
  */
 
+#include <sys/eventfd.h>
+#include <ifaddrs.h>
 #include "mytimer.h"
+#include "myevent.h"
+#include "mytopo.h"
+#include "mybatch.h"
+#include "mypacket.h"
+#include "mysnap.h"
+#include "myencode.h"
+#include "myroute.h"
+#include "mystatus.h"
+#include "mymetrics.h"
+#include "myfib.h"
+#include "mystate.h"
+#include "myconfig.h"
+#include "mycoalesce.h"
 
-#define UPDATE_INTERVAL 10  //also includes 0-4 seconds of randomness
-#define DEAD_ROUTE 40
-#define MAX_DISTANCE 16
+#define RECV_BATCH 32        //datagrams per recvmmsg()
+#define RECV_RING 128        //datagrams waiting for the route thread, a power of two
+#define RECV_BUDGET 32       //datagrams the route thread takes from a ring per wakeup
+#define COALESCE_BUDGET 128  //and how many more it looks ahead at for stale entries
+#define RECV_RESERVE 4       //with less than 1/4 of a ring free, senders over their share are shed
+#define PACE_BURST 32        //datagrams sent back to back, matches RECV_BATCH
+#define PACE_INTERVAL 10     //milliseconds between bursts
+#define PRINT_INTERVAL 1     //seconds
+#define SNAPSHOT_INTERVAL 100  //milliseconds, the most often the table is copied for readers
+#define FIB_INTERVAL 100     //milliseconds, route changes within this are written to the kernel together
+#define STATE_INTERVAL 5     //seconds, the most often the state file is written
 
+typedef struct instance instance__t;
+
+//how many datagrams one sender has waiting in a worker's ring
 typedef struct {
-    uint32_t distance;
-    uint32_t next_hop;
-    struct sockaddr_in destaddr;
-    uint32_t destination;
-    time_t last_updated;
-    int neighbor;
-} node__t;
+    uint64_t source;            //see source_key()
+    int count;                  //0 = free slot
+} share__t;
 
+//a receive thread, with its share of every instance's sockets
 typedef struct {
-    uint8_t command;      //2 = response
-    uint8_t version;      //1 = RIP v1
-    uint16_t num_entries; 
-    uint8_t entries;      
-} packet__t;
+    int id;
+    evloop__t loop;
+    rxring__t ring;             //-> route thread
+    ripreader__t *decoded;      //the worker's verdict on each ring buffer
+    instance__t **received_by;  //whose socket each ring buffer came in on
+    uint64_t *source_of;        //worker only, who sent each ring buffer
+    share__t *shares;           //worker only, 2 * ring size, see count_shares()
+    coalescer__t coalesce;      //route thread, the ring's backlog
+    unsigned coalesced;         //ring position the backlog is indexed up to
+} worker__t;
 
+//an instance's socket on one interface (or all of them) for one worker
 typedef struct {
-    uint8_t family;    //2 = IP
-    uint16_t blank1;   //00
-    uint32_t addr;     
-    uint32_t blank2;   //0000
-    uint32_t blank3;   //0000
-    uint32_t distance; 
-} entry__t;
-
-node__t **topo = NULL;
-node__t *this = NULL;
-int local_port = 0;
-int sockfd = 0;
-mytimer_t tmr_send_routes = TIMER_INIT;
-mytimer_t tmr_check_dead_routes = TIMER_INIT;
-
-void parse_node_config(char *nodefp);
-void parse_neighbor_config(char *neighborfp);
-node__t *get_node(uint32_t nick);
-int sizeof_topo();
-void print_node(node__t *node);
-void print_topo();
-void free_topo();
-packet__t *new_packet(int num_entries);
-int sizeof_packet(packet__t *pkt);
-void create_route_packet(time_t now);
-void send_routes(packet__t *p_routes);
-void check_route_validity(time_t now);
-node__t *is_neighbor(struct sockaddr_in addr);
-void update_routes(packet__t *p_recv, node__t *sender);
+    int fd;
+    instance__t *inst;
+    worker__t *worker;
+    uint32_t drops;             //kernel's count of datagrams it dropped, worker only
+} rxsocket__t;
+
+//one node from node.config that this process is
+struct instance {
+    router__t router;           //route thread
+    int local_port;
+    rxsocket__t *sockets;       //num_workers per interface, updates are sent from worker 0's
+    txlist__t neighbors;        //sender thread
+    uint32_t *neighbor_ids;     //node id of each destination in neighbors, ascending
+    txqueue__t txqueue;         //encoded updates waiting to be paced out, sender thread
+    int swap_waiting;           //a new neighbor list waits for txqueue to empty, sender thread
+    snapdomain__t snapshots;
+    int tx_reader;              //snapshot reader ids
+    int state_reader;
+    status__t status;
+    mytimer_t route_timers[ROUTE_TIMERS];
+    mytimer_t tmr_pace;
+    mytimer_t tmr_publish;
+    mytimer_t tmr_fib;
+    fib__t fib;                 //route thread
+    char *state_path;
+    uint64_t saved;             //snapshot version in the state file, state thread
+
+    //work handed from the route thread to the sender thread
+    struct {
+        pthread_mutex_t lock;
+        int efd;                //eventfd, readable while there is work
+        int full;               //send the whole table from the latest snapshot
+        routeentry__t *routes;  //then these changed routes
+        int count;
+        int alloced;
+        int swap;               //start sending to these neighbors instead, after a reload
+        txlist__t neighbors;
+        uint32_t *neighbor_ids;
+    } sendreq;
+};
+
+instance__t *instances;
+int num_instances = 0;
+evloop__t loop;             //route thread
+evloop__t tx_loop;          //sender thread
+worker__t *workers;
+int num_workers = 1;
+int recv_ring = RECV_RING;
+int rcvbuf = 0;             //0 = the system's default
+char *interfaces[TX_SOCKETS] = {NULL};  //NULL = every interface
+int num_interfaces = 0;
+int verbose = 0;
+int packet_size = RIP_MAX_PACKET;
+int update_interval = UPDATE_INTERVAL;  //milliseconds
+int table_limit = TABLE_LIMIT;
+int fib_table = 0;          //0 = don't touch the kernel's routes
+char *state_path = NULL;
+char *node_path, *neighbor_path;
+int reload_efd;             //eventfd, readable after a SIGHUP
+
+int all_ports(char *nodefp, int **ports);
+void instance_init(instance__t *inst, int port, int print_interval, int format);
+int open_socket(struct sockaddr_in *addr, const char *ifname);
+void instance_start(instance__t *inst);
+void instance_free(instance__t *inst);
+int parse_node_config(char *nodefp, int port, topo__t *topo, node__t **self);
+int parse_neighbor_config(char *neighborfp, topo__t *topo, node__t *self);
+void find_neighbors(instance__t *inst, txlist__t *list, uint32_t **ids);
+void reload_config(void *arg);
+void reload_instance(instance__t *inst);
+void notify(int efd);
+void publish_snapshot(time_t now, void *arg);
+void schedule_snapshots();
+time_t route_now(router__t *r);
+void route_set_timer(router__t *r, int timer, time_t when);
+void update_timer_fired(time_t now, void *arg);
+void expire_timer_fired(time_t now, void *arg);
+void trigger_timer_fired(time_t now, void *arg);
+void route_send_full(router__t *r);
+void route_send_changed(router__t *r, routeentry__t *routes, int count);
+void route_forwarding_changed(router__t *r, node__t *node);
+void sync_fib(time_t now, void *arg);
+void request_send(instance__t *inst, int full, routeentry__t *routes, int count);
+void request_neighbors(instance__t *inst, txlist__t *list, uint32_t *ids);
+void send_requested(void *arg);
+void flush_routes(instance__t *inst, encoder__t *e);
+void send_routes(time_t now, void *arg);
+void receive_packets(void *arg);
+void coalesce_ring(worker__t *w, int n);
+uint64_t source_key(instance__t *inst, struct sockaddr_in *addr);
+void receive_datagrams(void *arg);
+int count_shares(worker__t *w, unsigned from, unsigned to);
+share__t *find_share(worker__t *w, uint64_t source);
+void worker_init(worker__t *w, int id);
+void start_thread(void *(*thread)(void *), void *arg);
+void *receive_thread(void *arg);
+void *sender_thread(void *arg);
+void *state_thread(void *arg);
+void status_signal(int sig);
+void reload_signal(int sig);
+
+//the route thread runs the routers on real time and real sockets, r->env is the instance__t
+const routeops__t daemon_ops = {route_now, route_set_timer, route_send_full, route_send_changed, route_forwarding_changed};
+void (*const route_callbacks[ROUTE_TIMERS])(time_t, void *) = {update_timer_fired, expire_timer_fired, trigger_timer_fired};
 
 int main(int argc, char **argv)
 {
-    int n, len;
-    struct sockaddr_in incaddr;
-    packet__t *p_recv = new_packet(sizeof_topo());
-    fd_set rset;
-    struct timeval tv;
-    
+    int opt, print_interval = PRINT_INTERVAL, format = STATUS_TABLE;
+    char *metrics_path = NULL;
+    int *ports;
+    struct sigaction sa;
+
     srand(time(NULL));
-    
-    if (argc != 4) {
-        printf("Usage: %s <node.config> <neightbor.config> <local_port>\n\n", argv[0]);
+    metrics_thread("route");
+
+    while ((opt = getopt(argc, argv, "u:m:n:p:ci:w:q:B:S:F:R:v")) != -1) {
+        switch (opt) {
+        case 'u':
+            update_interval = strtod(optarg, NULL) * 1000;
+            break;
+        case 'm':
+            packet_size = rip_packet_size(strtoul(optarg, NULL, 10));
+            break;
+        case 'n':
+            table_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            print_interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            format = STATUS_COMPACT;
+            break;
+        case 'i':
+            if (num_interfaces == TX_SOCKETS) {
+                err_quit("  main(): at most %d interfaces\n\n", TX_SOCKETS);
+            }
+            interfaces[num_interfaces++] = optarg;
+            break;
+        case 'w':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            recv_ring = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            rcvbuf = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            metrics_path = optarg;
+            break;
+        case 'F':
+            fib_table = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            state_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            argc = 0;  //force the usage message
+        }
+    }
+
+    if (argc - optind < 3) {
+        printf("Usage: %s [-u update_interval] [-m mtu] [-n max_routes] [-p print_interval] [-c] [-i interface]... [-w workers] [-q queue_depth] [-B rcvbuf] [-S metrics_socket] [-F table] [-R state_file] [-v] <node.config> <neightbor.config> <local_port>... | all\n\n", argv[0]);
         exit(1);
     }
-    
-    local_port = strtoul(argv[3], NULL, 10);
-    parse_node_config(argv[1]);
-    parse_neighbor_config(argv[2]);
-    
-    print_topo();
-    
-    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
-    this->destaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    Bind(sockfd, (SA *) &(this->destaddr), sizeof(this->destaddr));
-    
-    //printf("starting timers: %u\n", time(NULL));
-    timer_start(&tmr_send_routes, UPDATE_INTERVAL+(rand()%5), create_route_packet);
-    timer_start(&tmr_check_dead_routes, DEAD_ROUTE, check_route_validity);
-    
-    for (;;) {
-        
-        len = sizeof(incaddr);
-        
-        tv_init(&tv);
-        tv_timer(&tv, &tmr_send_routes);
-        tv_timer(&tv, &tmr_check_dead_routes);
-        
-        FD_ZERO(&rset);
-        FD_SET(sockfd, &rset);
-        
-        //printf("entering select: sec=%ld, usec=%ld\n", (long)tv.tv_sec, (long)tv.tv_usec);
-        int n;
-        if ((n = select(sockfd+1, &rset, NULL, NULL, &tv)) < 0) {
-            err_quit("select() < 0, strerror(errno) = %s\n", strerror(errno));
+
+    node_path = argv[optind];
+    neighbor_path = argv[optind + 1];
+    if (strcmp(argv[optind + 2], "all") == 0) {
+        num_instances = all_ports(node_path, &ports);
+    } else {
+        num_instances = argc - optind - 2;
+        if ((ports = malloc(num_instances * sizeof(int))) == NULL) {
+            err_sys("  main(): ERROR allocating memory!\n\n");
         }
-        
-        //check for packet arrival
-        if (FD_ISSET(sockfd, &rset)) {
-            n = recvfrom(sockfd,
-                         p_recv,  //header -  pkt->entries   +        N       *     entries
-                         sizeof(packet__t) - sizeof(uint8_t) + (sizeof_topo() * sizeof(entry__t)),
-                         0,
-                         (SA *) &incaddr,
-                         &len);
-            if (n < 0) {
-                printf("recvfrom() error: %s\n", strerror(errno));
-                //error, ignore it?
-            } else if (n == 0) {
-                printf("recvfrom() error: n == 0\n");
-                //"peer has performed an orderly shutdown"
-                //What do?
-            } else {
-                //If the packet isn't from a neighbor then we don't care
-                node__t *sender;
-                if ((sender = is_neighbor(incaddr)) != NULL) {
-                    //TODO: do things with the packet
-                    printf("got packet with %d entries from %s:%u\n", 
-                        p_recv->num_entries, 
-                        inet_ntoa(incaddr.sin_addr),
-                        ntohs(incaddr.sin_port)
-                    );
-                    update_routes(p_recv, sender);
-                } else {
-                    printf("got packet from a non-neighbor, ignoring.\n");
+        for (int i = 0; i < num_instances; i++) {
+            ports[i] = strtoul(argv[optind + 2 + i], NULL, 10);
+            for (int j = 0; j < i; j++) {
+                if (ports[j] == ports[i]) {
+                    printf("  main(): port %d is given more than once\n\n", ports[i]);
+                    exit(1);
                 }
-                
             }
-            free(p_recv);
-            p_recv = new_packet(sizeof_topo());
         }
-        
-        //printf("  ...checking timers\n");
-        timer_check(&tmr_send_routes);
-        timer_check(&tmr_check_dead_routes);
-        
-        
-        print_topo();
     }
-    
-    free_topo();
+    if (num_interfaces == 0) num_interfaces = 1;  //one socket on INADDR_ANY
+    if (recv_ring < RECV_BATCH) recv_ring = RECV_BATCH;
+    while (recv_ring & (recv_ring - 1)) recv_ring += recv_ring & -recv_ring;
+    if (num_workers <= 0) {
+        //one per core, as long as that doesn't add buffers beyond -q
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers > recv_ring / RECV_BATCH) num_workers = recv_ring / RECV_BATCH;
+    }
+    if (fib_table && num_instances > 1) {
+        err_quit("  main(): -F works with one node only, not %d\n\n", num_instances);
+    }
+
+    if ((reload_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err_sys("  main(): eventfd() ERROR");
+    }
+    if ((workers = calloc(num_workers, sizeof(worker__t))) == NULL) {
+        err_sys("  main(): ERROR allocating memory!\n\n");
+    }
+    for (int i = 0; i < num_workers; i++) {
+        worker_init(&workers[i], i);
+    }
+
+    if ((instances = calloc(num_instances, sizeof(instance__t))) == NULL) {
+        err_sys("  main(): ERROR allocating memory!\n\n");
+    }
+    for (int i = 0; i < num_instances; i++) {
+        instance_init(&instances[i], ports[i], print_interval, format);
+        if (i > 0) {
+            //one status thread prints every table
+            status_join(&instances[i].status, &instances[0].status);
+        }
+    }
+    free(ports);
+
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = status_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = reload_signal;
+    sigaction(SIGHUP, &sa, NULL);
+
+    //the route thread's loop owns the tables and every route timer
+    ev_init(&loop);
+    for (int i = 0; i < num_workers; i++) {
+        ev_add(&loop, workers[i].ring.efd, receive_packets, &workers[i]);
+    }
+    ev_add(&loop, reload_efd, reload_config, NULL);
+    for (int i = 0; i < num_instances; i++) {
+        instance_start(&instances[i]);
+    }
+    loop.idle = schedule_snapshots;
+
+    for (int i = 0; i < num_workers; i++) {
+        start_thread(receive_thread, &workers[i]);
+    }
+    start_thread(sender_thread, NULL);
+    start_thread(status_thread, &instances[0].status);
+    if (state_path) {
+        start_thread(state_thread, NULL);
+    }
+    if (metrics_path) {
+        start_thread(metrics_server, (void *) (intptr_t) metrics_listen(metrics_path));
+    }
+
+    //within one wakeup the packets taken from the rings are handled before any timer
+    ev_run(&loop);
+
+    for (int i = 0; i < num_workers; i++) {
+        rxring_free(&workers[i].ring);
+        coalesce_free(&workers[i].coalesce);
+        free(workers[i].decoded);
+        free(workers[i].received_by);
+        free(workers[i].source_of);
+        free(workers[i].shares);
+    }
+    free(workers);
+    for (int i = 0; i < num_instances; i++) {
+        instance_free(&instances[i]);
+    }
+    free(instances);
 }
 
-void parse_node_config(char *nodefp)
+// Every port in node.config, for running all of its nodes.  Returns how
+// many there are.
+int all_ports(char *nodefp, int **ports)
 {
-    int num_alloced = 4;
-    FILE *fp = fopen(nodefp, "r");
-    
-    if (!fp) {
-        printf("  parse_node_config(): fopen(%s) ERROR.\n\n", nodefp);
+    struct sockaddr_in addr;
+    uint32_t nick;
+    config__t c;
+    int count = 0;
+
+    if (config_open(&c, nodefp) < 0) {
+        printf("  all_ports(): open(%s) ERROR: %s\n\n", nodefp, strerror(errno));
         exit(2);
     }
-    
-    if ((topo = calloc(num_alloced + 1, sizeof(node__t*))) == NULL) {
-        err_sys("  parse_node_config(): ERROR allocating memory!\n\n");
-    } 
-    
-    for (int i = 0; 1; i++) {
-        char buffer[100],
-             ipaddr[20];
-        uint32_t nick;
-        int port;
-        
-        if (i >= num_alloced) {//We need more space!
-            num_alloced *= 2;
-            //Get us more space
-            if ((topo = realloc(topo, (sizeof(node__t*) * (num_alloced + 1)))) == NULL) {
-                err_sys("parse_node_config(): ERROR allocating memory!\n\n");
-            }
-            
-            //Why isn't there a Recalloc?
-            int j;
-            for (j = num_alloced/2; j < num_alloced + 1; j++) {
-                topo[j] = NULL;
-            }
-        }
-        
-        //Initialize space for next node
-        if ((topo[i] = calloc(1, sizeof(node__t))) == NULL) {
-            err_sys("  parse_node_config(): ERROR allocating memory!\n\n");
+    if ((*ports = malloc(config_lines(&c) * sizeof(int))) == NULL) {
+        err_sys("  all_ports(): ERROR allocating memory!\n\n");
+    }
+    while (config_node(&c, &nick, &addr)) {
+        (*ports)[count++] = ntohs(addr.sin_port);
+    }
+    if (config_close(&c) > 0) exit(2);
+    if (count == 0) {
+        printf("  all_ports(): no nodes in %s\n\n", nodefp);
+        exit(2);
+    }
+    return count;
+}
+
+// Loads the node with this port from the config files and opens its
+// socket.  Exits if the files are bad, as there's nothing to run then.
+void instance_init(instance__t *inst, int port, int print_interval, int format)
+{
+    static const mytimer_t idle = TIMER_INIT;
+    router__t *r = &inst->router;
+
+    for (int i = 0; i < ROUTE_TIMERS; i++) {
+        inst->route_timers[i] = idle;
+    }
+    inst->tmr_pace = inst->tmr_publish = inst->tmr_fib = idle;
+
+    router_init(r, 4, &daemon_ops, inst);
+    r->update_interval = update_interval;
+    r->dead_route = 4 * update_interval;
+    r->garbage_route = 3 * update_interval;
+    r->table_limit = table_limit;
+    r->verbose = verbose;
+
+    inst->local_port = port;
+    if (parse_node_config(node_path, port, &r->topo, &r->self) > 0) exit(2);
+    if (parse_neighbor_config(neighbor_path, &r->topo, r->self) > 0) exit(3);
+
+    //bind a copy so self->destaddr stays valid in the address index
+    struct sockaddr_in bindaddr = r->self->destaddr;
+    bindaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((inst->sockets = calloc(num_interfaces * num_workers, sizeof(rxsocket__t))) == NULL) {
+        err_sys("  instance_init(): ERROR allocating memory!\n\n");
+    }
+    for (int i = 0; i < num_interfaces * num_workers; i++) {
+        inst->sockets[i].fd = open_socket(&bindaddr, interfaces[i / num_workers]);
+        inst->sockets[i].inst = inst;
+        inst->sockets[i].worker = &workers[i % num_workers];
+    }
+
+    //every update goes to the same neighbors, so only look for them once
+    find_neighbors(inst, &inst->neighbors, &inst->neighbor_ids);
+
+    txqueue_init(&inst->txqueue);
+    snap_init(&inst->snapshots);
+    inst->tx_reader = snap_add_reader(&inst->snapshots);
+    inst->state_reader = snap_add_reader(&inst->snapshots);
+    status_init(&inst->status, &inst->snapshots, print_interval, format);
+
+    pthread_mutex_init(&inst->sendreq.lock, NULL);
+    if ((inst->sendreq.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        err_sys("  instance_init(): eventfd() ERROR");
+    }
+
+    if (state_path && num_instances > 1) {
+        size_t len = strlen(state_path) + 12;
+        if ((inst->state_path = malloc(len)) == NULL) {
+            err_sys("  instance_init(): ERROR allocating memory!\n\n");
         }
-        topo[i]->distance = MAX_DISTANCE;
-        topo[i]->last_updated = time(NULL);
-        bzero(&(topo[i]->destaddr), sizeof(topo[i]->destaddr));
-        topo[i]->destaddr.sin_family = AF_INET;
-        
-        //Get next line in file
-        if ((fgets(buffer, 100, fp)) == NULL) {
-            //if it's an empty string, we're at EOF
-            free(topo[i]);
-            topo[i] = NULL;
-            break;
+        snprintf(inst->state_path, len, "%s.%u", state_path, r->self->destination);
+    } else {
+        inst->state_path = state_path;
+    }
+}
+
+// A UDP socket bound to addr, on one interface if ifname isn't NULL.  With
+// more than one worker it joins the SO_REUSEPORT group for addr.
+int open_socket(struct sockaddr_in *addr, const char *ifname)
+{
+    int fd = Socket(AF_INET, SOCK_DGRAM, 0), on = 1;
+
+    if (ifname && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname) + 1) < 0) {
+        err_sys("  open_socket(): SO_BINDTODEVICE %s ERROR", ifname);
+    }
+    if (num_workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        err_sys("  open_socket(): SO_REUSEPORT ERROR");
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        printf("  open_socket(): SO_RXQ_OVFL: %s, kernel drops won't be counted\n", strerror(errno));
+    }
+    if (rcvbuf > 0) {
+        static int reported = 0;
+        int size;
+        socklen_t len = sizeof(size);
+
+        //past rmem_max only with CAP_NET_ADMIN, otherwise take what we can get
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
         }
-        
-        if (sscanf(buffer, "%u %s %d", &nick, ipaddr, &port) != 3) {
-            printf("  sscanf() failed\n");
-            free(topo[i]);
-            topo[i] = NULL;
-            break;
+        //the kernel doubles it for its own overhead and reports that
+        if (!reported++ && getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0) {
+            printf("receive buffer is %d bytes per socket\n", size / 2);
         }
-        
+    }
+    Bind(fd, (SA *) addr, sizeof(*addr));
+    return fd;
+}
+
+// Hands inst's timers to the route thread's loop and starts its router.
+void instance_start(instance__t *inst)
+{
+    for (int i = 0; i < ROUTE_TIMERS; i++) {
+        ev_add_timer(&loop, &inst->route_timers[i], inst);
+    }
+    ev_add_timer(&loop, &inst->tmr_publish, inst);
+    ev_add_timer(&loop, &inst->tmr_fib, inst);
+
+    //printf("starting timers: %u\n", time(NULL));
+    router_start(&inst->router);
+    if (inst->state_path) {
+        int restored = state_load(inst->state_path, &inst->router);
+        if (restored >= 0) printf("restored %d routes from %s\n", restored, inst->state_path);
+    }
+    if (fib_table) {
+        //start from a clean slate: ours, and nothing left from an earlier run
+        fib_open(&inst->fib, fib_table, verbose);
+        fib_resync(&inst->fib, &inst->router.topo);
+        sync_fib(loop.now, inst);
+    }
+
+    //the status thread prints this one as soon as it starts
+    publish_snapshot(loop.now, inst);
+}
+
+void instance_free(instance__t *inst)
+{
+    for (int i = 0; i < num_interfaces * num_workers; i++) {
+        close(inst->sockets[i].fd);
+    }
+    free(inst->sockets);
+    txlist_free(&inst->neighbors);
+    free(inst->neighbor_ids);
+    txqueue_free(&inst->txqueue);
+    snap_free(&inst->snapshots);
+    if (fib_table) fib_close(&inst->fib);
+    if (inst->state_path != state_path) free(inst->state_path);
+    free(inst->sendreq.routes);
+    router_free(&inst->router);
+}
+
+// Reads node.config into topo and points self at the node with this port.
+// Returns the number of errors, which have been printed.
+int parse_node_config(char *nodefp, int port, topo__t *topo, node__t **self)
+{
+    struct sockaddr_in destaddr;
+    uint32_t nick;
+    config__t c;
+
+    *self = NULL;
+    if (config_open(&c, nodefp) < 0) {
+        printf("  parse_node_config(): open(%s) ERROR: %s\n\n", nodefp, strerror(errno));
+        return 1;
+    }
+    topo_reserve(topo, config_lines(&c));
+
+    while (config_node(&c, &nick, &destaddr)) {
+        node__t *node;
+
         //Check for unique destinations
-        if (get_node(nick) != NULL) {
-            err_sys("  parse_node_config(): Duplicate node destinations!\n\n");
-        } else {
-            topo[i]->destination = nick;
-        }
-        
-        
-        //printf("local_port=%d, port=%d\n", local_port, port);
-        if (port == local_port) {
-            this = topo[i];
-            this->distance = 0;
-            this->next_hop = nick;
+        if ((node = topo_insert(topo, nick)) == NULL) {
+            config_error(&c, "node %u is listed more than once", nick);
+            continue;
         }
-        
-        topo[i]->destaddr.sin_port = htons(port);
-        if (inet_pton(AF_INET, ipaddr, &(topo[i]->destaddr.sin_addr)) <= 0)
-        {
-            printf("parse_node_config():  inet_pton(%s) ERROR\n\n", ipaddr);
-            free(topo[i]);
-            topo[i] = NULL;
-            break;
+        node->distance = MAX_DISTANCE;
+        node->last_updated = timer_now();
+        node->destaddr = destaddr;
+        topo_index_addr(topo, node);
+
+        if (ntohs(destaddr.sin_port) == port) {
+            if (*self) {
+                config_error(&c, "node %u has port %d too, which is already node %u's", nick, port, (*self)->destination);
+                continue;
+            }
+            node->distance = 0;
+            node->next_hop = nick;
+            *self = node;
         }
-        
     }
-    fclose(fp);
-    //print_topo();
+    int errors = config_close(&c);
+
+    if (!*self) {
+        printf("  parse_node_config(): no node in %s has port %d\n\n", nodefp, port);
+        errors++;
+    }
+    return errors;
 }
 
-void parse_neighbor_config(char *neighborfp)
+// Reads neighbor.config and marks self's neighbors in topo.  Returns the
+// number of errors, which have been printed.
+int parse_neighbor_config(char *neighborfp, topo__t *topo, node__t *self)
 {
-    char buffer[100];
-    uint32_t from, to;
-    int dist;
-    FILE *fp = fopen(neighborfp, "r");
-    
-    if (!fp) {
-        printf("  parse_neighbor_config(): fopen(%s) ERROR.\n\n", neighborfp);
-        exit(3);
+    uint32_t from, to, dist;
+    config__t c;
+
+    if (config_open(&c, neighborfp) < 0) {
+        printf("  parse_neighbor_config(): open(%s) ERROR: %s\n\n", neighborfp, strerror(errno));
+        return 1;
     }
-    
-    while ((fgets(buffer, 100, fp)) != NULL) {
-        //printf("parse_neighbor_config(): got %s", buffer);
-        if (sscanf(buffer, "%u %u %d", &from, &to, &dist) != 3) {
-            printf("  parse_neighbor_config(): sscanf(%s) ERROR.\n\n", buffer);
+
+    while (config_link(&c, &from, &to, &dist)) {
+        node__t *a = topo_find(topo, from), *b = topo_find(topo, to);
+
+        if (a == NULL || b == NULL) {
+            config_error(&c, "node %u isn't in node.config", a ? to : from);
+            continue;
+        }
+        if (a == b) {
+            config_error(&c, "node %u is linked to itself", from);
+            continue;
+        }
+        if (dist == 0) {
+            config_error(&c, "cost must be at least 1");
+            continue;
         }
-        
-        //Is it better to quit or invalidate the line?
         if (dist >= MAX_DISTANCE) {
-            printf("  parse_neighbor_config(): dist=%d >= MAX=%d.  Skipping connection.\n\n", dist, MAX_DISTANCE);
+            config_warn(&c, "cost %u >= %d is unreachable, skipping the link", dist, MAX_DISTANCE);
             continue;
         }
-        
-        if (from == this->destination) {
-            get_node(to)->distance = dist;
-            //get_node(to)->next_hop = to;
-            get_node(to)->neighbor = 1;
-        } else if (to == this->destination) {
-            get_node(from)->distance = dist;
-            //get_node(from)->next_hop = from;
-            get_node(from)->neighbor = 1;
+
+        if (a == self) {
+            a = b;
+        } else if (b != self) {
+            continue;
         }
+        a->distance = dist;
+        a->cost = dist;
+        a->neighbor = 1;
     }
-    fclose(fp);
-    //print_neighbors();
+    return config_close(&c);
 }
 
-node__t *get_node(uint32_t nick)
+// Lists the neighbors in inst's table to send updates to, in id order so
+// a route's next hop can be found by binary search (see myencode.c).
+// With -i each one is sent to through its interface's socket.
+void find_neighbors(instance__t *inst, txlist__t *list, uint32_t **ids)
 {
-    for (int i = 0; topo[i]; i++) {
-        if (topo[i]->destination == nick) {
-            return topo[i];
+    topo__t *topo = &inst->router.topo;
+    struct ifaddrs *ifs = NULL;
+    int count = 0;
+
+    if ((*ids = malloc((topo->used + 1) * sizeof(uint32_t))) == NULL) {
+        err_sys("  find_neighbors(): ERROR allocating memory!\n\n");
+    }
+    for (int i = 0; i < topo->used; i++) {
+        if (topo_node(topo, i)->destination != 0 && topo_node(topo, i)->neighbor) {
+            (*ids)[count++] = topo_node(topo, i)->destination;
         }
     }
-    return NULL;
+    qsort(*ids, count, sizeof(uint32_t), cmp_id);
+    txlist_init(list);
+    if (interfaces[0] && getifaddrs(&ifs) < 0) {
+        printf("  find_neighbors(): getifaddrs() error: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_in addr = topo_find(topo, (*ids)[i])->destaddr;
+        int iface = -1;
+
+        txlist_add(list, addr);
+        if (!interfaces[0]) continue;
+
+        for (struct ifaddrs *ifa = ifs; ifa && iface < 0; ifa = ifa->ifa_next) {
+            if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || !ifa->ifa_netmask) continue;
+
+            in_addr_t local = ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr;
+            in_addr_t mask = ((struct sockaddr_in *) ifa->ifa_netmask)->sin_addr.s_addr;
+            if ((local & mask) != (addr.sin_addr.s_addr & mask)) continue;
+            for (int k = 0; k < num_interfaces; k++) {
+                if (strcmp(ifa->ifa_name, interfaces[k]) == 0) iface = k;
+            }
+        }
+        if (iface < 0) {
+            printf("  find_neighbors(): neighbor %u (%s) isn't on any -i interface, sending through %s\n",
+                   (*ids)[i], inet_ntoa(addr.sin_addr), interfaces[0]);
+        } else if (iface > 0) {
+            txlist_set_socket(list, i, inst->sockets[iface * num_workers].fd);
+        }
+    }
+    if (ifs) freeifaddrs(ifs);
+}
+
+// Route thread side, called when reload_efd is readable.
+void reload_config(void *arg)
+{
+    uint64_t count;
+
+    if (read(reload_efd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    printf("reloading %s and %s\n", node_path, neighbor_path);
+    for (int i = 0; i < num_instances; i++) {
+        reload_instance(&instances[i]);
+    }
 }
 
-int sizeof_topo()
-{
-    if (!topo) return 0;
-    for (int i = 0; topo[i]; i++) {
-		if (!topo[i+1]) {
-			return i+1;
-		}
-	}
-    return 0;
-}
-
-void print_node(node__t *node)
-{
-    if (!node) return;
-    
-    
-    int max_distance_width = (int)floor(log10((double)abs(MAX_DISTANCE))) + 1; //from https://stackoverflow.com/a/1068870
-    int label_width = (int)floor(log10((double)abs(sizeof_topo()))) + 1;
-    int time_width = (int)floor(log10((double)abs(DEAD_ROUTE))) + 1;
-    
-    printf("%p  %*u%c | %*d@%*u    %*u     %s:%u",
-        node,  //%p
-        label_width,  //%*u
-        node->destination,  //%*u
-        ((node == this)?  //%c
-           ('*')
-           :((node->neighbor == 0)?
-              (' ')
-              :('-')
-            )
-        ),
-        max_distance_width,  //%*d
-        node->distance,  //%*d
-        label_width, //(int)floor(log10(abs((float)sizeof_topo()))) + 1,  //%*u
-        (node->next_hop == 0)?(0):(node->next_hop),  //%*u
-        time_width,
-        (time(NULL) - node->last_updated),  //%*u
-        inet_ntoa(node->destaddr.sin_addr),  //%s
-        ntohs(node->destaddr.sin_port)  //%u
-    );
-}
-
-void print_topo()
-{
-    if (!topo) return;
-    
-    printf("------------------Topography--------------------\n");
-    printf("Node            | Dist     Time   IP\n");
-    printf("------------------------------------------------\n");
-    
-    for (int i = 0; topo[i]; i++) {
-        print_node(topo[i]);
-        printf("\n");
-    }
-    printf("------------------------------------------------\n\n\n\n\n");
-}
-
-void free_topo()
-{
-    for (int i = 0; topo[i]; i++) {
-        free(topo[i]);
-    }
-    free(topo);
-}
-
-packet__t *new_packet(int num_entries)
-{
-    packet__t *p_new = calloc(1, sizeof(packet__t) 
-                                      - sizeof(uint8_t) 
-                                      + (num_entries * sizeof(entry__t)));
-                                      
-    if (!p_new) {
-        err_sys("  new_blank_packet(): ERROR allocating memory!\n\n");
-    }
-    p_new->command = 2;
-    p_new->version = 1;
-    p_new->num_entries = num_entries;
-    
-    entry__t *entries = (entry__t*) &(p_new->entries);
-    for (int i = 0; i < p_new->num_entries; i++) {
-        entries[i].family = 2;
-    }
-    
-    return p_new;
-}
-
-int sizeof_packet(packet__t *pkt)
-{
-    return (sizeof(packet__t) 
-            - sizeof(uint8_t) 
-            + (pkt->num_entries * sizeof(entry__t))
-           );
-}
-
-void create_route_packet(time_t now)
-{
-    printf("create_route_packet() started: %u\n", time(NULL));
-    
-    int num_routes = 0;
-    packet__t *p_routes;
-    entry__t *p_entries;
-    
-    //how big is our packet?
-    for (int i = 0; topo[i]; i++) {
-        if (topo[i]->next_hop != 0) {
-            num_routes++;
+// Reads both config files again and applies the difference to inst's
+// live table: nodes that are new or moved, nodes that are gone, and
+// links that appeared, went or changed cost.  Routes not touched by any
+// of that stay as they are.  If either file has errors nothing changes.
+void reload_instance(instance__t *inst)
+{
+    router__t *r = &inst->router;
+    int added = 0, removed = 0, moved = 0, links = 0;
+    topo__t next;
+    node__t *self;
+
+    topo_init(&next, r->topo.count);
+    if (parse_node_config(node_path, inst->local_port, &next, &self) > 0
+            || parse_neighbor_config(neighbor_path, &next, self) > 0) {
+        printf("  reload_instance(): keeping the current configuration\n\n");
+        topo_free(&next);
+        return;
+    }
+    if (self->destination != r->self->destination) {
+        printf("  reload_instance(): port %d is node %u now, not %u, restart to change that\n\n",
+               inst->local_port, self->destination, r->self->destination);
+        topo_free(&next);
+        return;
+    }
+
+    //gone from node.config, stop sending to them before letting them go
+    for (int i = 0; i < r->topo.used; i++) {
+        node__t *node = topo_node(&r->topo, i);
+        if (node->destination == 0 || node->learned || topo_find(&next, node->destination)) continue;
+
+        if (node->neighbor) {
+            router_set_cost(r, node, 0);
+            links++;
         }
+        router_remove_node(r, node);
+        removed++;
     }
-    
-    //create packet
-    p_routes = new_packet(num_routes);
-    entry__t *entries = (entry__t*) &(p_routes->entries);
-    
-    //fill in packet entries 
-    for (int i = 0; topo[i]; i++) {
-        if (topo[i]->next_hop != 0) {
-            entries->addr = topo[i]->destination;
-            entries->distance = topo[i]->distance;
-            entries++;
+
+    for (int i = 0; i < next.used; i++) {
+        node__t *want = topo_node(&next, i);
+        node__t *node = get_node(r, want->destination);
+
+        if (!node || node->learned) {
+            added++;
+        } else if (node->destaddr.sin_addr.s_addr != want->destaddr.sin_addr.s_addr
+                || node->destaddr.sin_port != want->destaddr.sin_port) {
+            moved++;
+        }
+        node = router_add_node(r, want->destination, want->destaddr);
+
+        uint32_t cost = (want->neighbor)?(want->cost):(0);
+        if (cost != ((node->neighbor)?(node->cost):(0))) {
+            router_set_cost(r, node, cost);
+            links++;
         }
     }
-    
-    printf("  create_route_packet(): created packet with %d entries:\n", p_routes->num_entries);
-    entry__t *tmp = (entry__t*) &(p_routes->entries);
-    
-    for (int i = 0; i < p_routes->num_entries; i++) {
-        printf("  create_route_packet(): entry %d - %d@%u\n", i, tmp[i].distance, (char) tmp[i].addr);
-    }
-    
-    //send packet to neighbors
-    if (p_routes->num_entries > 0) {
-        send_routes(p_routes);
-    }
-    free(p_routes);
-    
-    //reset timer
-    timer_start(&tmr_send_routes, UPDATE_INTERVAL+(rand()%5), create_route_packet);
-}
-
-void send_routes(packet__t *p_routes)
-{
-    for (int i = 0; topo[i]; i++) {
-        if (topo[i]->neighbor) {
-            /*
-            printf("  send_routes(): sending to %s:%u\n",
-                    inet_ntoa(topo[i]->destaddr.sin_addr),
-                    ntohs(topo[i]->destaddr.sin_port)
-                   );
-            */
-            Sendto(sockfd,
-                   p_routes,
-                   sizeof_packet(p_routes),
-                   0,
-                   (SA *) &(topo[i]->destaddr),
-                   sizeof(topo[i]->destaddr)
-                  );
+    topo_free(&next);
+
+    if (links > 0 || moved > 0) {
+        txlist__t list;
+        uint32_t *ids;
+
+        find_neighbors(inst, &list, &ids);
+        request_neighbors(inst, &list, ids);
+    }
+    printf("reloaded node %u: %d nodes added, %d removed, %d moved, %d links changed\n",
+           r->self->destination, added, removed, moved, links);
+}
+
+void notify(int efd)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) < 0) {
+        printf("  notify(): eventfd write error: %s\n", strerror(errno));
+    }
+}
+
+// Copies inst's table for the sender and status threads.
+void publish_snapshot(time_t now, void *arg)
+{
+    instance__t *inst = arg;
+
+    snap_publish(&inst->snapshots, snap_build(&inst->router.topo, inst->router.self));
+    inst->router.stale = 0;
+    timer_clear(&inst->tmr_publish);
+    status_changed(&inst->status);
+}
+
+// The route thread's idle hook.  Copying a big table after every packet
+// would cost more than handling the packet, so copy at most every
+// SNAPSHOT_INTERVAL.
+void schedule_snapshots()
+{
+    for (int i = 0; i < num_instances; i++) {
+        instance__t *inst = &instances[i];
+        if (inst->router.stale && !timer_pending(&inst->tmr_publish)) {
+            timer_start_msec(&inst->tmr_publish, SNAPSHOT_INTERVAL, publish_snapshot);
+        }
+    }
+}
+
+// The time the route thread woke up, so a burst of updates touching
+// thousands of routes doesn't read the clock for each of them.
+time_t route_now(router__t *r)
+{
+    return loop.now;
+}
+
+void route_set_timer(router__t *r, int timer, time_t when)
+{
+    instance__t *inst = r->env;
+
+    if (when == TIME_T_MAX) {
+        timer_clear(&inst->route_timers[timer]);
+    } else {
+        timer_start_at(&inst->route_timers[timer], when, route_callbacks[timer]);
+    }
+}
+
+void update_timer_fired(time_t now, void *arg)
+{
+    router_timer(&((instance__t *) arg)->router, ROUTE_TMR_UPDATE, now);
+}
+
+void expire_timer_fired(time_t now, void *arg)
+{
+    router_timer(&((instance__t *) arg)->router, ROUTE_TMR_EXPIRE, now);
+}
+
+void trigger_timer_fired(time_t now, void *arg)
+{
+    router_timer(&((instance__t *) arg)->router, ROUTE_TMR_TRIGGER, now);
+}
+
+// The sender builds the dump from the latest snapshot, so make it current.
+void route_send_full(router__t *r)
+{
+    publish_snapshot(loop.now, r->env);
+    request_send(r->env, 1, NULL, 0);
+}
+
+void route_send_changed(router__t *r, routeentry__t *routes, int count)
+{
+    request_send(r->env, 0, routes, count);
+}
+
+// Changes within FIB_INTERVAL of the first one are written together,
+// and a route that flapped back meanwhile isn't written at all.
+void route_forwarding_changed(router__t *r, node__t *node)
+{
+    instance__t *inst = r->env;
+
+    if (!fib_table) return;
+
+    fib_changed(&inst->fib, node);
+    if (!timer_pending(&inst->tmr_fib)) {
+        timer_start_msec(&inst->tmr_fib, FIB_INTERVAL, sync_fib);
+    }
+}
+
+void sync_fib(time_t now, void *arg)
+{
+    instance__t *inst = arg;
+
+    fib_flush(&inst->fib, &inst->router.topo, inst->router.self);
+}
+
+// Route thread side.  Asks the sender thread for a full dump and/or
+// the given routes.  Requests made before the sender gets to them pile up.
+void request_send(instance__t *inst, int full, routeentry__t *routes, int count)
+{
+    pthread_mutex_lock(&inst->sendreq.lock);
+    if (full) {
+        //the dump has everything older requests would have sent
+        inst->sendreq.full = 1;
+        inst->sendreq.count = 0;
+    }
+    if (inst->sendreq.count + count > inst->sendreq.alloced) {
+        inst->sendreq.alloced = 2 * (inst->sendreq.count + count);
+        if ((inst->sendreq.routes = realloc(inst->sendreq.routes, inst->sendreq.alloced * sizeof(routeentry__t))) == NULL) {
+            err_sys("  request_send(): ERROR allocating memory!\n\n");
+        }
+    }
+    memcpy(inst->sendreq.routes + inst->sendreq.count, routes, count * sizeof(routeentry__t));
+    inst->sendreq.count += count;
+    pthread_mutex_unlock(&inst->sendreq.lock);
+
+    notify(inst->sendreq.efd);
+}
+
+// Route thread side.  Hands the sender thread a new list of neighbors,
+// which takes the place of the current one once it has been read.
+void request_neighbors(instance__t *inst, txlist__t *list, uint32_t *ids)
+{
+    pthread_mutex_lock(&inst->sendreq.lock);
+    if (inst->sendreq.swap) {
+        //the sender never got to the last one
+        txlist_free(&inst->sendreq.neighbors);
+        free(inst->sendreq.neighbor_ids);
+    }
+    inst->sendreq.neighbors = *list;
+    inst->sendreq.neighbor_ids = ids;
+    inst->sendreq.swap = 1;
+    pthread_mutex_unlock(&inst->sendreq.lock);
+
+    notify(inst->sendreq.efd);
+}
+
+// Sender thread side, called when an instance's sendreq.efd is readable.
+void send_requested(void *arg)
+{
+    //only ever swapped with an instance's, so there are always enough to go round
+    static routeentry__t *routes = NULL;
+    static int alloced = 0;
+    instance__t *inst = arg;
+    uint64_t count;
+    encoder__t e;
+    txlist__t next;
+    uint32_t *next_ids = NULL;
+    int full, swap, num_routes = 0;
+
+    if (read(inst->sendreq.efd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    //swap buffers so the route thread can queue more while we encode
+    pthread_mutex_lock(&inst->sendreq.lock);
+    if (inst->sendreq.swap && !inst->sendreq.full && inst->txqueue.sent < inst->txqueue.count) {
+        //what's queued was poisoned for the current list, so it goes out
+        //to that one at the usual pace first; send_routes() brings us back
+        //here once it's gone, and the work waits until then
+        inst->swap_waiting = 1;
+        pthread_mutex_unlock(&inst->sendreq.lock);
+        return;
+    }
+    routeentry__t *tmp = inst->sendreq.routes;
+    int tmp_alloced = inst->sendreq.alloced;
+    inst->sendreq.routes = routes;
+    inst->sendreq.alloced = alloced;
+    routes = tmp;
+    alloced = tmp_alloced;
+    full = inst->sendreq.full;
+    count = inst->sendreq.count;
+    inst->sendreq.full = inst->sendreq.count = 0;
+    if ((swap = inst->sendreq.swap)) {
+        next = inst->sendreq.neighbors;
+        next_ids = inst->sendreq.neighbor_ids;
+        inst->sendreq.swap = 0;
+    }
+    pthread_mutex_unlock(&inst->sendreq.lock);
+
+    if (swap) {
+        //the queue is empty, or about to be replaced by a full update
+        txlist_free(&inst->neighbors);
+        free(inst->neighbor_ids);
+        inst->neighbors = next;
+        inst->neighbor_ids = next_ids;
+    }
+
+    encode_begin(&e, &inst->txqueue, inst->neighbor_ids, inst->neighbors.count, packet_size);
+    if (full) {
+        //whatever is still queued is older than this
+        txqueue_reset(&inst->txqueue);
+
+        //fill in packet entries, expired routes are sent until garbage collected
+        snapshot__t *snap = snap_enter(&inst->snapshots, inst->tx_reader);
+        if (snap) num_routes += encode_snapshot(&e, snap);
+        snap_exit(&inst->snapshots, inst->tx_reader);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        encode_route(&e, routes[i].destination, routes[i].metric, routes[i].next_hop, routes[i].more_hops);
+        num_routes++;
+    }
+    flush_routes(inst, &e);
+
+    if (full && verbose) {
+        printf("  send_requested(): queued %d routes\n", num_routes);
+    }
+}
+
+// Finishes the last datagram and starts sending if we aren't already.
+void flush_routes(instance__t *inst, encoder__t *e)
+{
+    encode_end(e);
+    if (!timer_pending(&inst->tmr_pace)) {
+        send_routes(tx_loop.now, inst);
+    }
+}
+
+// Sends one burst of queued datagrams to every neighbor, then comes back
+// for the next one after PACE_INTERVAL so the neighbors' receive buffers
+// can keep up with a large table.
+void send_routes(time_t now, void *arg)
+{
+    instance__t *inst = arg;
+
+    if (txqueue_send(&inst->txqueue, &inst->neighbors, inst->sockets[0].fd, PACE_BURST) > 0) {
+        timer_start_msec(&inst->tmr_pace, PACE_INTERVAL, send_routes);
+    } else if (inst->swap_waiting) {
+        inst->swap_waiting = 0;
+        notify(inst->sendreq.efd);
+    }
+}
+
+// Route thread side, called when a worker's ring.efd is readable.  The
+// worker has already thrown out anything that isn't a well-formed packet.
+void receive_packets(void *arg)
+{
+    worker__t *w = arg;
+    int n = rxring_ready(&w->ring);
+
+    if (n > RECV_BUDGET) {
+        //behind: skip what newer updates replace, and come back for the rest
+        coalesce_ring(w, n);
+        n = RECV_BUDGET;
+        metric_add(METRIC_RX_DEFERRED, 1);
+        rxring_defer(&w->ring);
+    } else {
+        coalesce_reset(&w->coalesce);
+        w->coalesced = w->ring.tail + n;
+    }
+
+    for (int i = 0; i < n; i++) {
+        unsigned seq = w->ring.tail + i;
+        struct sockaddr_in *incaddr = rxring_addr(&w->ring, seq);
+        ripreader__t *r = &w->decoded[seq % w->ring.size];
+        router__t *router = &w->received_by[seq % w->ring.size]->router;
+        node__t *sender;
+
+        if (r->num_entries < 0) continue;
+
+        //If the packet isn't from a neighbor then we don't care
+        if ((sender = is_neighbor(router, *incaddr)) == NULL) {
+            metric_add(METRIC_RX_NOT_NEIGHBOR, 1);
+            if (verbose) printf("got packet from a non-neighbor, ignoring.\n");
+        } else if (r->command != RIP_RESPONSE) {
+            metric_add(METRIC_RX_REQUESTS, 1);
+            if (verbose) printf("got request from %s:%u, ignoring.\n",
+                inet_ntoa(incaddr->sin_addr),
+                ntohs(incaddr->sin_port)
+            );
+        } else {
+            if (verbose) printf("got packet with %d entries from %s:%u\n",
+                r->num_entries,
+                inet_ntoa(incaddr->sin_addr),
+                ntohs(incaddr->sin_port)
+            );
+            uint64_t start = metric_clock();
+            update_routes(router, r, sender);
+            metric_observe(HIST_UPDATE, metric_clock() - start);
         }
     }
+    if (n > 0) rxring_release(&w->ring, n);
 }
 
-void check_route_validity(time_t now)
+// Route thread side.  Indexes the entries of up to COALESCE_BUDGET of the
+// n datagrams waiting in w's ring that haven't been yet, and blanks every
+// older entry from the same neighbor to the same node for the same
+// destination.  A blanked entry has address family 0, which
+// rip_next_entry() skips.
+void coalesce_ring(worker__t *w, int n)
 {
-    printf("check_route_validity() started: %u\n", time(NULL));
-    
-    int next_death = DEAD_ROUTE;
-    
-    for (int i = 0; topo[i]; i++) {
-        if (topo[i] == this) {
-            topo[i]->last_updated = time(NULL);
-        } else if (time(NULL) - topo[i]->last_updated > DEAD_ROUTE) {
-            topo[i]->next_hop = 0;
-            topo[i]->last_updated = time(NULL);
+    unsigned end = w->ring.tail + n;
+    int coalesced = 0;
+
+    if ((int) (w->coalesced - w->ring.tail) < 0) w->coalesced = w->ring.tail;
+    if ((int) (end - w->coalesced) > COALESCE_BUDGET) end = w->coalesced + COALESCE_BUDGET;
+    for (; w->coalesced != end; w->coalesced++) {
+        unsigned seq = w->coalesced;
+        ripreader__t scan = w->decoded[seq % w->ring.size];
+        struct sockaddr_in *incaddr = rxring_addr(&w->ring, seq);
+        router__t *router = &w->received_by[seq % w->ring.size]->router;
+        ripentry__t entry;
+        unsigned old_seq;
+        uint32_t old_off;
+
+        //strangers' datagrams are thrown out unread, they don't get to fill the index
+        if (scan.num_entries < 0 || scan.command != RIP_RESPONSE || !is_neighbor(router, *incaddr)) continue;
+
+        uint64_t source = source_key(w->received_by[seq % w->ring.size], incaddr);
+        while (rip_next_entry(&scan, &entry)) {
+            uint32_t off = scan.off - RIP_ENTRY_SIZE;
+            if (coalesce_add(&w->coalesce, source, entry.destination, seq, off, w->ring.tail, &old_seq, &old_off)) {
+                rip_clear_entry(rxring_buf(&w->ring, old_seq), old_off);
+                coalesced++;
+            }
         }
     }
-    
-    for (int i = 0; topo[i]; i++) {
-        if ((DEAD_ROUTE - (time(NULL) - topo[i]->last_updated)) < next_death) {
-            next_death = (DEAD_ROUTE - (time(NULL) - topo[i]->last_updated));
+    metric_add(METRIC_RX_COALESCED, coalesced);
+}
+
+// What tells two senders apart in a worker's ring: the node they sent to,
+// and their address and port.
+uint64_t source_key(instance__t *inst, struct sockaddr_in *addr)
+{
+    return (uint64_t) (inst - instances) << 48 | (uint64_t) ntohl(addr->sin_addr.s_addr) << 16 | ntohs(addr->sin_port);
+}
+
+void start_thread(void *(*thread)(void *), void *arg)
+{
+    pthread_t tid;
+    int err;
+
+    if ((err = pthread_create(&tid, NULL, thread, arg)) != 0) {
+        err_quit("  start_thread(): pthread_create() ERROR: %s\n", strerror(err));
+    }
+    pthread_detach(tid);
+}
+
+// Worker side, called when one of its sockets is readable.  Reads a
+// batch of datagrams and checks that they are RIP packets, so the route
+// thread only ever sees work it has to do.
+//
+// Once less than 1/RECV_RESERVE of the ring is free, a datagram whose
+// sender already has its share of the ring waiting (the ring split evenly
+// between the senders in it, plus one for a newcomer) is dropped.  A
+// flooding neighbor then can't fill the ring, so the worker never waits
+// for room while the kernel drops everyone's datagrams; it keeps reading
+// the socket, and the other neighbors' updates find their way in.
+void receive_datagrams(void *arg)
+{
+    rxsocket__t *sock = arg;
+    worker__t *w = sock->worker;
+    uint32_t drops = sock->drops;
+    int n = rxring_recv(&w->ring, sock->fd, RECV_BATCH, &drops);
+    int room = rxring_room(&w->ring), kept = 0, senders = -1;
+
+    if (drops != sock->drops) {
+        metric_add(METRIC_RX_KERNEL_DROPS, drops - sock->drops);
+        if (verbose) printf("kernel dropped %u datagrams on port %d\n", drops - sock->drops, sock->inst->local_port);
+        sock->drops = drops;
+    }
+    metric_add(METRIC_RX_DATAGRAMS, n);
+    for (int i = 0; i < n; i++) {
+        unsigned seq = w->ring.head + kept;
+        struct sockaddr_in *incaddr = rxring_addr(&w->ring, w->ring.head + i);
+        uint64_t source = source_key(sock->inst, incaddr);
+
+        metric_add(METRIC_RX_BYTES, rxring_len(&w->ring, w->ring.head + i));
+        if (room - kept < w->ring.size / RECV_RESERVE) {
+            if (senders < 0) senders = count_shares(w, w->ring.head - (w->ring.size - room), seq);
+
+            share__t *share = find_share(w, source);
+            int newcomer = (share->count == 0);
+            if (share->count >= w->ring.size / (senders + newcomer + 1)) {
+                metric_add(METRIC_RX_SHED, 1);
+                continue;
+            }
+            share->count++;
+            senders += newcomer;
         }
+        if (i != kept) rxring_move(&w->ring, seq, w->ring.head + i);
+        kept++;
+
+        ripreader__t *r = &w->decoded[seq % w->ring.size];
+        incaddr = rxring_addr(&w->ring, seq);
+        w->received_by[seq % w->ring.size] = sock->inst;
+        w->source_of[seq % w->ring.size] = source;
+        if (rip_reader_init(r, rxring_buf(&w->ring, seq), rxring_len(&w->ring, seq)) < 0) {
+            metric_add(METRIC_RX_MALFORMED, 1);
+            r->num_entries = -1;
+            if (verbose) printf("got malformed packet (%d bytes) from %s:%u, ignoring.\n",
+                rxring_len(&w->ring, seq),
+                inet_ntoa(incaddr->sin_addr),
+                ntohs(incaddr->sin_port)
+            );
+        }
+    }
+    rxring_publish(&w->ring, kept);
+}
+
+// Worker side.  Counts into w->shares how many datagrams each sender has
+// from ring position from up to to, and returns how many senders that is.
+int count_shares(worker__t *w, unsigned from, unsigned to)
+{
+    int senders = 0;
+
+    bzero(w->shares, 2 * w->ring.size * sizeof(share__t));
+    for (unsigned seq = from; seq != to; seq++) {
+        share__t *share = find_share(w, w->source_of[seq % w->ring.size]);
+        senders += (share->count++ == 0);
+    }
+    return senders;
+}
+
+// Worker side.  The sender's entry in w->shares, a free one (count 0)
+// with its source filled in if it has none.  There are never more
+// senders than ring buffers, so there is always a free one.
+share__t *find_share(worker__t *w, uint64_t source)
+{
+    unsigned mask = 2 * w->ring.size - 1;
+    unsigned k = (source * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+
+    while (w->shares[k].count > 0 && w->shares[k].source != source) k = (k + 1) & mask;
+    w->shares[k].source = source;
+    return &w->shares[k];
+}
+
+// The workers split the -q datagrams between them, down to RECV_BATCH
+// each, so an explicit -w beyond -q / RECV_BATCH adds RECV_BATCH buffers
+// per worker.
+void worker_init(worker__t *w, int id)
+{
+    int size = recv_ring;
+
+    while (size > RECV_BATCH && size * num_workers > recv_ring) size /= 2;
+
+    w->id = id;
+    //neighbors may use a bigger MTU than we do, so take any datagram
+    rxring_init(&w->ring, size, MAX_DATAGRAM);
+    w->decoded = calloc(size, sizeof(ripreader__t));
+    w->received_by = calloc(size, sizeof(instance__t *));
+    w->source_of = calloc(size, sizeof(uint64_t));
+    w->shares = calloc(2 * size, sizeof(share__t));
+    if (!w->decoded || !w->received_by || !w->source_of || !w->shares) {
+        err_sys("  worker_init(): ERROR allocating memory!\n\n");
     }
-    
-    //TODO: check_dead_routes should figure out when the next one will be invalid, not a const
-    timer_start(&tmr_check_dead_routes, next_death + 1, check_route_validity);
+    //a ring's worth of full datagrams, more only comes from neighbors with a bigger MTU
+    coalesce_init(&w->coalesce, size * ((packet_size - RIP_HEADER_SIZE) / RIP_ENTRY_SIZE));
 }
 
-node__t *is_neighbor(struct sockaddr_in addr)
+// A receive worker.  Waits on its socket of every instance and interface
+// and fills its own ring.
+void *receive_thread(void *arg)
 {
-    for (int i = 0; topo[i]; i++) {
-        if ((topo[i]->destaddr.sin_addr.s_addr == addr.sin_addr.s_addr) 
-                && (topo[i]->destaddr.sin_port == addr.sin_port)) {
-            return topo[i];
+    worker__t *w = arg;
+    char name[16];
+
+    if (num_workers > 1) {
+        snprintf(name, sizeof(name), "receive%d", w->id);
+    } else {
+        snprintf(name, sizeof(name), "receive");
+    }
+    metrics_thread(name);
+    ev_init(&w->loop);
+    for (int i = 0; i < num_instances; i++) {
+        for (int k = 0; k < num_interfaces; k++) {
+            rxsocket__t *sock = &instances[i].sockets[k * num_workers + w->id];
+            ev_add(&w->loop, sock->fd, receive_datagrams, sock);
         }
     }
+    ev_run(&w->loop);
     return NULL;
 }
 
-void update_routes(packet__t *p_recv, node__t *sender)
+// Encodes updates from snapshots and paces them out, so a big table
+// never holds up the route thread.
+void *sender_thread(void *arg)
 {
-    entry__t *entries = (entry__t*) &(p_recv->entries);
-    for (int i = 0; i < p_recv->num_entries; i++) {
-        node__t *node = get_node(entries[i].addr);
-        
-        printf("  entries[%d]: old_dist=%d, new_dist=%d via %d\n", i, node->distance, (entries[i].distance + sender->distance), sender->destination);
-        
-        if ((entries[i].distance + sender->distance) <= node->distance) {
-            node->distance = (entries[i].distance + sender->distance);
-            node->distance = (node->distance > MAX_DISTANCE)?(MAX_DISTANCE):(node->distance);
-            
-            node->next_hop = sender->destination;
-        
-            node->last_updated = time(NULL);
-        } 
+    metrics_thread("sender");
+    ev_init(&tx_loop);
+    for (int i = 0; i < num_instances; i++) {
+        ev_add(&tx_loop, instances[i].sendreq.efd, send_requested, &instances[i]);
+        ev_add_timer(&tx_loop, &instances[i].tmr_pace, &instances[i]);
     }
+    ev_run(&tx_loop);
+    return NULL;
+}
+
+// Saves each instance's latest snapshot every STATE_INTERVAL, if it changed.
+void *state_thread(void *arg)
+{
+    for (;;) {
+        sleep(STATE_INTERVAL);
+
+        for (int i = 0; i < num_instances; i++) {
+            instance__t *inst = &instances[i];
+            snapshot__t *snap = snap_enter(&inst->snapshots, inst->state_reader);
+            if (snap && snap->version != inst->saved && state_save(inst->state_path, snap) == 0) {
+                inst->saved = snap->version;
+            }
+            snap_exit(&inst->snapshots, inst->state_reader);
+        }
+    }
+    return NULL;
+}
+
+// The status threads' eventfds are shared, see status_join().
+void status_signal(int sig)
+{
+    status_request(&instances[0].status);
+}
+
+void reload_signal(int sig)
+{
+    uint64_t one = 1;
+
+    //only async-signal-safe calls in here, so not notify()
+    if (write(reload_efd, &one, sizeof(one)) < 0) return;
 }
@@ -0,0 +1,585 @@
+/*
+ * myroute.c
+ *
+ * The RIP route computation for one router: applying updates to the
+ * table, deciding what to advertise and when, and expiring routes.  It
+ * doesn't know about sockets or real time.  Whoever owns the router
+ * supplies a clock, timers and a way to send updates through a
+ * routeops__t, so the same code runs in the myrip daemon and in the
+ * mysim simulator.  Times and intervals are in milliseconds.
+ */
+
+#include "myroute.h"
+#include "mymetrics.h"
+
+static void route_changed(router__t *r, node__t *node);
+static int find_hop(node__t *node, uint32_t hop);
+static int drop_hop(node__t *node, int slot);
+static void add_hop(router__t *r, node__t *node, uint32_t hop);
+static void set_only_hop(node__t *node, uint32_t hop);
+static time_t route_deadline(router__t *r, node__t *node);
+static void route_expired(uint32_t index, time_t now, void *arg);
+static void refresh_route(router__t *r, node__t *node);
+static void start_garbage_collection(router__t *r, node__t *node);
+static void route_lost(router__t *r, node__t *node);
+static void schedule_route(router__t *r, node__t *node, time_t deadline);
+static node__t *learn_node(router__t *r, uint32_t nick);
+
+static time_t router_now(router__t *r)
+{
+    return r->ops->now(r);
+}
+
+// When the next full dump is due after one at now.  The randomness keeps
+// routers from synchronizing (RFC 2453 3.8), and is scaled down with
+// the interval so sub-second intervals stay sub-second.
+static time_t next_update(router__t *r, time_t now)
+{
+    int spread = (r->update_interval / 2 < RANDOM_SPREAD)?(r->update_interval / 2):(RANDOM_SPREAD);
+    return now + r->update_interval + ((spread > 0)?(rand() % spread):(0));
+}
+
+static void log_time(router__t *r, const char *what, time_t now)
+{
+    if (r->verbose) printf("%s started: %lld.%03d\n", what, (long long) now / 1000, (int) (now % 1000));
+}
+
+static void set_timer(router__t *r, int timer, time_t when)
+{
+    r->timers[timer] = when;
+    r->ops->set_timer(r, timer, when);
+}
+
+// Call this whenever node's distance or set of next hops changes.
+static void forwarding_changed(router__t *r, node__t *node)
+{
+    if (r->ops->forwarding_changed) r->ops->forwarding_changed(r, node);
+}
+
+// Call this whenever the table changes in a way the owner should see.
+static void table_changed(router__t *r)
+{
+    r->stale = 1;
+    //a sum over every router in the process
+    metric_add(METRIC_ROUTES, (uint64_t) (r->topo.count - r->counted));
+    r->counted = r->topo.count;
+}
+
+// num_nodes is only a hint for sizing the table.  Fill it in and set the
+// intervals, then call router_start().
+void router_init(router__t *r, int num_nodes, const routeops__t *ops, void *env)
+{
+    bzero(r, sizeof(*r));
+    topo_init(&r->topo, num_nodes);
+    r->update_interval = UPDATE_INTERVAL;
+    r->dead_route = DEAD_ROUTE;
+    r->garbage_route = GARBAGE_ROUTE;
+    r->table_limit = TABLE_LIMIT;
+    for (int i = 0; i < ROUTE_TIMERS; i++) {
+        r->timers[i] = TIME_T_MAX;
+    }
+    r->ops = ops;
+    r->env = env;
+}
+
+void router_start(router__t *r)
+{
+    time_t now = router_now(r);
+
+    //routes get a deadline in the wheel once they're learned
+    wheel_init(&r->wheel, r->topo.alloced, now);
+    r->last_change = now;
+
+    if (r->update_interval > 0) {
+        set_timer(r, ROUTE_TMR_UPDATE, next_update(r, now));
+    }
+}
+
+// The owner calls this when one of the timers it was asked to set goes off.
+// Timers that were moved or stopped meanwhile are ignored.
+void router_timer(router__t *r, int timer, time_t now)
+{
+    if (r->timers[timer] == TIME_T_MAX || r->timers[timer] > now) return;
+    r->timers[timer] = TIME_T_MAX;
+
+    switch (timer) {
+    case ROUTE_TMR_UPDATE:
+        create_route_packet(r, now);
+        break;
+    case ROUTE_TMR_EXPIRE:
+        check_route_validity(r, now);
+        break;
+    case ROUTE_TMR_TRIGGER:
+        create_triggered_packet(r, now);
+        break;
+    }
+}
+
+// Puts back a route saved by an earlier run, with hops[] its next hops
+// (TOPO_PATHS of them, 0 = unused).  Call it after router_start().  The
+// route is advertised right away but goes again unless one of its next
+// hops confirms it within RESTORE_ROUNDS update intervals.  Returns 0 if
+// the route couldn't be used: no next hop is still a neighbor, the
+// table is full, or the table already has a route for it.
+int router_restore(router__t *r, uint32_t destination, uint32_t distance, const uint32_t *hops)
+{
+    time_t now = router_now(r);
+    node__t *node = get_node(r, destination);
+
+    if (distance >= MAX_DISTANCE || (node && node->next_hop != 0)) return 0;
+    if (!node && (node = learn_node(r, destination)) == NULL) return 0;
+
+    for (int i = 0; i < TOPO_PATHS && hops[i] != 0; i++) {
+        node__t *hop = get_node(r, hops[i]);
+        if (!hop || !hop->neighbor) continue;
+
+        if (node->next_hop == 0) {
+            set_only_hop(node, hops[i]);
+        } else {
+            add_hop(r, node, hops[i]);
+        }
+    }
+    if (node->next_hop == 0) {
+        if (node->learned) topo_remove(&r->topo, node);
+        return 0;
+    }
+
+    //backdate it so the usual expiry takes it unless it's confirmed
+    node->distance = distance;
+    node->restored = 1;
+    node->last_updated = now - r->dead_route + RESTORE_ROUNDS * r->update_interval;
+    for (int i = 0; i < TOPO_PATHS - 1; i++) {
+        node->more_updated[i] = node->last_updated;
+    }
+    route_changed(r, node);
+    schedule_route(r, node, route_deadline(r, node));
+
+    //neighbors that lost routes through us hear about them now, not next round
+    if (r->update_interval > 0 && r->timers[ROUTE_TMR_UPDATE] > now) {
+        set_timer(r, ROUTE_TMR_UPDATE, now);
+    }
+    return 1;
+}
+
+// Adds a destination from node.config, or updates its address if it's
+// in the table already.  One that was only learned from updates keeps
+// its route but isn't removed when that goes any more.
+node__t *router_add_node(router__t *r, uint32_t destination, struct sockaddr_in addr)
+{
+    node__t *node = get_node(r, destination);
+
+    if (node == NULL) {
+        if ((node = topo_insert(&r->topo, destination)) == NULL) return NULL;
+        node->distance = MAX_DISTANCE;
+        node->last_updated = router_now(r);
+        wheel_reserve(&r->wheel, r->topo.alloced);
+        table_changed(r);
+    }
+    node->learned = 0;
+
+    if (node->destaddr.sin_addr.s_addr != addr.sin_addr.s_addr || node->destaddr.sin_port != addr.sin_port) {
+        topo_unindex_addr(&r->topo, node);
+        node->destaddr = addr;
+        topo_index_addr(&r->topo, node);
+        table_changed(r);
+    }
+    return node;
+}
+
+// The opposite, for a destination that is gone from node.config and
+// isn't a neighbor any more (see router_set_cost()).  A route to it stays
+// until it expires, like a learned one; without one it goes right away.
+void router_remove_node(router__t *r, node__t *node)
+{
+    topo_unindex_addr(&r->topo, node);
+    bzero(&node->destaddr, sizeof(node->destaddr));
+    node->destaddr.sin_family = AF_INET;
+    node->learned = 1;
+    table_changed(r);
+
+    if (node->next_hop == 0 && !node->garbage) {
+        wheel_cancel(&r->wheel, node->index);
+        topo_remove(&r->topo, node);
+    }
+}
+
+// Sets the link cost to neighbor, which makes it a neighbor if it wasn't
+// one, or with cost 0 makes it not one.  Routes through it are fixed up
+// right away, and only those go out in the next triggered update,
+// instead of waiting for its next update (or, for a link that's gone,
+// for them to time out).
+void router_set_cost(router__t *r, node__t *neighbor, uint32_t cost)
+{
+    uint32_t old = (neighbor->neighbor)?(neighbor->cost):(0);
+    time_t now = router_now(r);
+
+    if (cost == old) return;
+    neighbor->neighbor = (cost != 0);
+    neighbor->cost = cost;
+    table_changed(r);
+
+    if (old == 0) {
+        //a new neighbor, nothing goes through it yet, but it wants our table
+        if (r->update_interval > 0 && r->timers[ROUTE_TMR_UPDATE] > now) {
+            set_timer(r, ROUTE_TMR_UPDATE, now);
+        }
+        return;
+    }
+
+    for (int i = 0; i < r->topo.used; i++) {
+        node__t *node = topo_node(&r->topo, i);
+        int slot;
+
+        if (node->destination == 0 || node->next_hop == 0
+                || (slot = find_hop(node, neighbor->destination)) < 0) continue;
+
+        //gone, or now worse than the other next hops
+        if ((cost == 0 || cost > old) && drop_hop(node, slot)) {
+            table_changed(r);
+            forwarding_changed(r, node);
+            schedule_route(r, node, route_deadline(r, node));
+            continue;
+        }
+
+        uint32_t distance = node->distance - old + cost;
+        if (cost == 0 || distance >= MAX_DISTANCE) {
+            route_lost(r, node);
+            continue;
+        }
+
+        //better than the other next hops, if it had any
+        if (slot > 0) node->last_updated = node->more_updated[slot - 1];
+        set_only_hop(node, neighbor->destination);
+        node->distance = distance;
+        route_changed(r, node);
+        schedule_route(r, node, route_deadline(r, node));
+    }
+}
+
+void router_free(router__t *r)
+{
+    metric_add(METRIC_ROUTES, (uint64_t) -r->counted);
+    wheel_free(&r->wheel);
+    topo_free(&r->topo);
+    free(r->changed);
+    bzero(r, sizeof(*r));
+}
+
+node__t *get_node(router__t *r, uint32_t nick)
+{
+    return topo_find(&r->topo, nick);
+}
+
+int sizeof_topo(router__t *r)
+{
+    return r->topo.count;
+}
+
+void create_route_packet(router__t *r, time_t now)
+{
+    log_time(r, "create_route_packet()", now);
+
+    r->ops->send_full(r);
+    metric_add(METRIC_FULL_UPDATES, 1);
+
+    //a full dump carries every change, so a pending triggered update is redundant
+    topo_clear_dirty(&r->topo);
+    set_timer(r, ROUTE_TMR_TRIGGER, TIME_T_MAX);
+
+    //reset timer
+    set_timer(r, ROUTE_TMR_UPDATE, next_update(r, now));
+}
+
+void create_triggered_packet(router__t *r, time_t now)
+{
+    log_time(r, "create_triggered_packet()", now);
+
+    int count = 0;
+
+    if (r->topo.num_dirty > r->changed_alloced) {
+        r->changed_alloced = r->topo.alloced;
+        if ((r->changed = realloc(r->changed, r->changed_alloced * sizeof(routeentry__t))) == NULL) {
+            err_sys("  create_triggered_packet(): ERROR allocating memory!\n\n");
+        }
+    }
+
+    //only the routes that changed since the last update, including
+    //the ones that became unreachable
+    for (int i = 0; i < r->topo.num_dirty; i++) {
+        node__t *node = topo_node(&r->topo, r->topo.dirty[i]);
+        if (node->destination != 0) {
+            r->changed[count].destination = node->destination;
+            r->changed[count].metric = (node->next_hop != 0)?(node->distance):(MAX_DISTANCE);
+            r->changed[count].next_hop = node->next_hop;
+            memcpy(r->changed[count].more_hops, node->more_hops, sizeof(node->more_hops));
+            count++;
+        }
+    }
+    r->ops->send_changed(r, r->changed, count);
+    metric_add(METRIC_TRIGGERED_UPDATES, 1);
+
+    if (r->verbose) printf("  create_triggered_packet(): queued %d routes\n", count);
+    topo_clear_dirty(&r->topo);
+    r->last_triggered = now;
+}
+
+// Marks node for the next triggered update, which goes out now or
+// TRIGGER_HOLDOFF after the last one, whichever is later.  The holdoff is
+// capped at the update interval, which would send the change anyway.
+static void route_changed(router__t *r, node__t *node)
+{
+    time_t now = router_now(r);
+
+    topo_mark_dirty(&r->topo, node);
+    table_changed(r);
+    forwarding_changed(r, node);
+    metric_add(METRIC_ROUTE_CHANGES, 1);
+    r->last_change = now;
+
+    if (r->timers[ROUTE_TMR_TRIGGER] == TIME_T_MAX) {
+        time_t holdoff = TRIGGER_HOLDOFF + rand() % RANDOM_SPREAD;
+        if (r->update_interval > 0 && holdoff > r->update_interval) holdoff = r->update_interval;
+
+        time_t when = r->last_triggered + holdoff;
+        set_timer(r, ROUTE_TMR_TRIGGER, (when < now)?(now):(when));
+    }
+}
+
+void check_route_validity(router__t *r, time_t now)
+{
+    log_time(r, "check_route_validity()", now);
+
+    //only the routes whose deadline has passed are looked at
+    wheel_advance(&r->wheel, now, route_expired, r);
+
+    //sleep until the next deadline in the wheel
+    set_timer(r, ROUTE_TMR_EXPIRE, wheel_next(&r->wheel));
+}
+
+static void route_expired(uint32_t index, time_t now, void *arg)
+{
+    router__t *r = arg;
+    node__t *node = topo_node(&r->topo, index);
+
+    if (node->next_hop != 0) {
+        time_t stale = now - r->dead_route;
+
+        //next hops that stopped confirming the route go, the others stay
+        for (int i = TOPO_PATHS - 1; i > 0; i--) {
+            if (node->more_hops[i - 1] != 0 && node->more_updated[i - 1] <= stale) drop_hop(node, i);
+        }
+        if (node->last_updated > stale || drop_hop(node, 0)) {
+            table_changed(r);
+            forwarding_changed(r, node);
+            schedule_route(r, node, route_deadline(r, node));
+            return;
+        }
+
+        //no update for dead_route, advertise it as unreachable for a while
+        node->next_hop = 0;
+        node->distance = MAX_DISTANCE;
+        metric_add(METRIC_ROUTES_EXPIRED, 1);
+        metric_add(METRIC_ROUTES_LOST, 1);
+        route_changed(r, node);
+        start_garbage_collection(r, node);
+    } else if (node->learned) {
+        //done advertising it, and we only knew about it from updates
+        topo_remove(&r->topo, node);
+        table_changed(r);
+    } else {
+        //done advertising it
+        node->garbage = 0;
+        table_changed(r);
+    }
+}
+
+// Call this whenever an update from next_hop confirms node's route.
+static void refresh_route(router__t *r, node__t *node)
+{
+    node->last_updated = router_now(r);
+    node->garbage = 0;
+    node->restored = 0;
+    table_changed(r);
+    schedule_route(r, node, route_deadline(r, node));
+}
+
+// Where hop is in node's next hops: 0 for next_hop, i + 1 for
+// more_hops[i], -1 if it isn't one of them.
+static int find_hop(node__t *node, uint32_t hop)
+{
+    if (node->next_hop == hop) return 0;
+    for (int i = 0; i < TOPO_PATHS - 1 && node->more_hops[i] != 0; i++) {
+        if (node->more_hops[i] == hop) return i + 1;
+    }
+    return -1;
+}
+
+// Removes the next hop at slot (see find_hop()).  When that's next_hop,
+// the longest-standing alternative takes over.  Returns 0, and leaves
+// node alone, if next_hop was the only one.
+static int drop_hop(node__t *node, int slot)
+{
+    if (slot == 0) {
+        if (node->more_hops[0] == 0) return 0;
+        node->next_hop = node->more_hops[0];
+        node->last_updated = node->more_updated[0];
+        slot = 1;
+    }
+    for (int i = slot - 1; i < TOPO_PATHS - 2; i++) {
+        node->more_hops[i] = node->more_hops[i + 1];
+        node->more_updated[i] = node->more_updated[i + 1];
+    }
+    node->more_hops[TOPO_PATHS - 2] = 0;
+    return 1;
+}
+
+// Adds an equal-cost next hop, if there is room for it.
+static void add_hop(router__t *r, node__t *node, uint32_t hop)
+{
+    for (int i = 0; i < TOPO_PATHS - 1; i++) {
+        if (node->more_hops[i] == 0) {
+            node->more_hops[i] = hop;
+            node->more_updated[i] = router_now(r);
+            table_changed(r);
+            forwarding_changed(r, node);
+            return;
+        }
+    }
+}
+
+static void set_only_hop(node__t *node, uint32_t hop)
+{
+    node->next_hop = hop;
+    bzero(node->more_hops, sizeof(node->more_hops));
+}
+
+// The route goes once every next hop has gone quiet, but is looked at
+// when the first one does.
+static time_t route_deadline(router__t *r, node__t *node)
+{
+    time_t oldest = node->last_updated;
+
+    for (int i = 0; i < TOPO_PATHS - 1 && node->more_hops[i] != 0; i++) {
+        if (node->more_updated[i] < oldest) oldest = node->more_updated[i];
+    }
+    return oldest + r->dead_route;
+}
+
+static void start_garbage_collection(router__t *r, node__t *node)
+{
+    node->garbage = 1;
+    node->last_updated = router_now(r);
+    table_changed(r);
+    schedule_route(r, node, node->last_updated + r->garbage_route);
+}
+
+// The last next hop is gone, advertise it as unreachable for a while.
+static void route_lost(router__t *r, node__t *node)
+{
+    node->next_hop = 0;
+    node->distance = MAX_DISTANCE;
+    bzero(node->more_hops, sizeof(node->more_hops));
+    metric_add(METRIC_ROUTES_LOST, 1);
+    route_changed(r, node);
+    start_garbage_collection(r, node);
+}
+
+static void schedule_route(router__t *r, node__t *node, time_t deadline)
+{
+    if (r->update_interval == 0) return;
+
+    wheel_schedule(&r->wheel, node->index, deadline);
+
+    //refreshes mostly push deadlines back, so only wake up earlier if we must
+    if (deadline < r->timers[ROUTE_TMR_EXPIRE]) {
+        set_timer(r, ROUTE_TMR_EXPIRE, deadline);
+    }
+}
+
+node__t *is_neighbor(router__t *r, struct sockaddr_in addr)
+{
+    node__t *node = topo_find_addr(&r->topo, addr);
+    return (node && node->neighbor)?(node):(NULL);
+}
+
+void update_routes(router__t *r, ripreader__t *rd, node__t *sender)
+{
+    ripentry__t entry;
+    int i;
+
+    for (i = 0; rip_next_entry(rd, &entry); i++) {
+        node__t *node = get_node(r, entry.destination);
+        uint32_t distance = entry.metric + sender->cost;
+        distance = (distance > MAX_DISTANCE)?(MAX_DISTANCE):(distance);
+
+        //a destination we haven't heard of, unless it's unreachable anyway
+        if (!node) {
+            if (distance >= MAX_DISTANCE || (node = learn_node(r, entry.destination)) == NULL) {
+                continue;
+            }
+        }
+
+        if (r->verbose) printf("  entries[%d]: old_dist=%d, new_dist=%d via %d\n", i, node->distance, distance, sender->destination);
+
+        int slot = (node->next_hop != 0)?(find_hop(node, sender->destination)):(-1);
+
+        if (slot >= 0 && distance == node->distance) {
+            //one of our next hops confirming the route
+            if (slot == 0) {
+                refresh_route(r, node);
+            } else {
+                node->more_updated[slot - 1] = router_now(r);
+                schedule_route(r, node, route_deadline(r, node));
+            }
+        } else if (slot >= 0 && distance > node->distance && drop_hop(node, slot)) {
+            //it got worse through this one, the others still have the best metric
+            table_changed(r);
+            forwarding_changed(r, node);
+            schedule_route(r, node, route_deadline(r, node));
+        } else if (slot == 0 && distance > node->distance) {
+            //RFC 2453 3.9.2, believe our only next hop even when it gets worse
+            node->distance = distance;
+            route_changed(r, node);
+            if (distance >= MAX_DISTANCE) {
+                metric_add(METRIC_ROUTES_LOST, 1);
+                node->next_hop = 0;
+                start_garbage_collection(r, node);
+            } else {
+                refresh_route(r, node);
+            }
+        } else if ((distance < MAX_DISTANCE) && ((distance < node->distance) || (node->next_hop == 0))) {
+            //a better route, through this neighbor alone
+            node->distance = distance;
+            set_only_hop(node, sender->destination);
+            route_changed(r, node);
+            refresh_route(r, node);
+        } else if ((distance < MAX_DISTANCE) && (distance == node->distance) && (slot < 0)) {
+            //as good as the route we have, spread over both
+            add_hop(r, node, sender->destination);
+        }
+    }
+    metric_add(METRIC_RX_ENTRIES, i);
+}
+
+// Adds a destination that isn't in node.config, or returns NULL if the
+// table is already table_limit nodes big.
+static node__t *learn_node(router__t *r, uint32_t nick)
+{
+    node__t *node;
+
+    if (sizeof_topo(r) >= r->table_limit) {
+        if (r->verbose) printf("  learn_node(): table is full (%d routes), ignoring %u\n", r->table_limit, nick);
+        return NULL;
+    }
+    if ((node = topo_insert(&r->topo, nick)) == NULL) {
+        return NULL;
+    }
+    node->distance = MAX_DISTANCE;
+    node->learned = 1;
+    node->destaddr.sin_family = AF_INET;
+
+    //the table grows a slab at a time, the wheel has to keep up
+    wheel_reserve(&r->wheel, r->topo.alloced);
+
+    return node;
+}
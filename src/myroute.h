@@ -0,0 +1,92 @@
+/*
+ * myroute.h
+ *
+ * The RIP route computation for one router: applying updates to the
+ * table, deciding what to advertise and when, and expiring routes.  It
+ * doesn't know about sockets or real time.  Whoever owns the router
+ * supplies a clock, timers and a way to send updates through a
+ * routeops__t, so the same code runs in the myrip daemon and in the
+ * mysim simulator.  Times and intervals are in milliseconds.
+ */
+
+#ifndef MYROUTE_H
+#define MYROUTE_H
+
+#include "mytimer.h"
+#include "mytopo.h"
+#include "mypacket.h"
+
+#define UPDATE_INTERVAL 10000  //plus up to RANDOM_SPREAD, or half the interval if that's less
+#define DEAD_ROUTE 40000
+#define GARBAGE_ROUTE 30000 //advertise expired routes as unreachable this long, RFC 2453 3.8
+#define MAX_DISTANCE RIP_INFINITY
+#define TABLE_LIMIT 100000
+#define TRIGGER_HOLDOFF 1000   //plus up to RANDOM_SPREAD, but never longer than the update interval, RFC 2453 3.10.1
+#define RANDOM_SPREAD 5000  //most randomness added to the update and trigger timers
+#define RESTORE_ROUNDS 2    //update intervals a restored route has to be confirmed in
+
+#define ROUTE_TMR_UPDATE 0  //next full table dump
+#define ROUTE_TMR_EXPIRE 1  //next route deadline
+#define ROUTE_TMR_TRIGGER 2 //next triggered update
+#define ROUTE_TIMERS 3
+
+typedef struct router router__t;
+
+typedef struct {
+    uint32_t destination;
+    uint32_t metric;
+    uint32_t next_hop;          //not sent, the owner poisons the route toward these
+    uint32_t more_hops[TOPO_PATHS - 1];
+} routeentry__t;
+
+typedef struct {
+    time_t (*now)(router__t *r);  //milliseconds, only ever goes forward
+    //(re)start timer to fire at when, TIME_T_MAX stops it, then call router_timer()
+    void (*set_timer)(router__t *r, int timer, time_t when);
+    //send every route in r->topo that's valid or being garbage collected,
+    //with metric MAX_DISTANCE to the neighbor it goes through (RFC 2453 3.4.3)
+    void (*send_full)(router__t *r);
+    //send just these routes, poisoned the same way
+    void (*send_changed)(router__t *r, routeentry__t *routes, int count);
+    //node's distance or next hops changed, may be NULL
+    void (*forwarding_changed)(router__t *r, node__t *node);
+} routeops__t;
+
+struct router {
+    topo__t topo;
+    node__t *self;
+    mywheel_t wheel;            //one deadline per node, by node->index
+    int update_interval;        //0 = no full dumps and no expiry
+    int dead_route;
+    int garbage_route;
+    int table_limit;
+    int verbose;                //log every packet and route to stdout
+    int stale;                  //set whenever the table changes, the owner clears it
+    time_t last_change;         //when a route last changed
+    int counted;                //routes added to METRIC_ROUTES so far
+    time_t timers[ROUTE_TIMERS];  //when each timer fires, TIME_T_MAX = stopped
+    time_t last_triggered;
+    routeentry__t *changed;     //scratch space for triggered updates
+    int changed_alloced;
+    const routeops__t *ops;
+    void *env;                  //the owner's, router never touches it
+};
+
+void router_init(router__t *r, int num_nodes, const routeops__t *ops, void *env);
+void router_start(router__t *r);
+void router_timer(router__t *r, int timer, time_t now);
+int router_restore(router__t *r, uint32_t destination, uint32_t distance, const uint32_t *hops);
+node__t *router_add_node(router__t *r, uint32_t destination, struct sockaddr_in addr);
+void router_remove_node(router__t *r, node__t *node);
+void router_set_cost(router__t *r, node__t *neighbor, uint32_t cost);
+void router_free(router__t *r);
+
+node__t *get_node(router__t *r, uint32_t nick);
+int sizeof_topo(router__t *r);
+node__t *is_neighbor(router__t *r, struct sockaddr_in addr);
+void update_routes(router__t *r, ripreader__t *rd, node__t *sender);
+void create_route_packet(router__t *r, time_t now);
+void create_triggered_packet(router__t *r, time_t now);
+void check_route_validity(router__t *r, time_t now);
+
+#endif
@@ -0,0 +1,646 @@
+/*
+ * mysim.c
+ *
+ * Usage: ./mysim [-u update_interval] [-m mtu] [-d delay_ms] [-t max_seconds] [-s seed] [-P] [-v]
+ *                (<node.config> <neighbor.config> | -g nodes[,degree])
+ *
+ *   -u  seconds between full table dumps, as for myrip (default 10,
+ *       fractions allowed)
+ *   -m  link MTU in bytes, as for myrip
+ *   -d  one-way link delay in milliseconds (default 1)
+ *   -t  give up after this many simulated seconds (default 3600)
+ *   -s  seed for the routers' random timer jitter
+ *   -g  make up a topology instead of reading one: a ring of nodes with
+ *       random chords added until the average degree is degree (default 4),
+ *       every link with cost 1
+ *   -P  send every neighbor the same updates, without poisoned reverse,
+ *       to compare against
+ *   -v  also print the counts for every node
+ *
+ * Runs every node of a topology as a router (myroute.c) in one process,
+ * on virtual time, with packets going through the real encoder and
+ * decoder.  It stops once no route has changed for a few update intervals
+ * and reports how long the network took to converge, how many datagrams
+ * and bytes each node sent, and how many routes disagree with the
+ * shortest paths.
+ *
+ * Every router ends up with a route to every node, so memory grows with
+ * the square of the number of nodes: 10000 nodes need roughly 10GB.
+ */
+
+#include "myroute.h"
+#include "mybatch.h"
+#include "myconfig.h"
+
+#define LINK_DELAY 1        //milliseconds
+#define MAX_SECONDS 3600
+#define DEGREE 4
+#define QUIET_INTERVALS 3   //converged once this many update intervals pass without a change
+
+#define SIM_TIMER 0
+#define SIM_DELIVER 1
+
+typedef struct {
+    uint32_t peer;          //simnode index
+    uint32_t cost;
+} simlink__t;
+
+typedef struct {
+    router__t router;
+    uint32_t id;
+    struct sockaddr_in addr;
+    simlink__t *links;
+    int num_links;
+    int alloced;
+    long messages;          //datagrams sent, one per neighbor
+    long bytes;             //UDP payload bytes sent
+} simnode__t;
+
+typedef struct {
+    int refs;               //deliveries still holding it
+    size_t len;
+    uint8_t data[];
+} simpacket__t;
+
+typedef struct {
+    uint64_t when;          //virtual milliseconds
+    uint64_t seq;           //keeps events at the same time in order
+    int type;
+    int timer;              //SIM_TIMER
+    uint32_t node;          //who it happens to
+    uint32_t from;          //SIM_DELIVER
+    simpacket__t *packet;   //SIM_DELIVER
+} simevent__t;
+
+simnode__t *nodes = NULL;
+int num_nodes = 0;
+topo__t ids = TOPO_INIT;     //node ids from node.config, index = position in nodes
+simevent__t *events = NULL; //binary min-heap on (when, seq)
+int num_events = 0;
+int events_alloced = 0;
+uint64_t next_seq = 0;
+uint64_t now_ms = 0;
+time_t last_change = 0;     //the last time any router changed a route
+int update_interval = UPDATE_INTERVAL;
+int link_delay = LINK_DELAY;
+int packet_size = RIP_MAX_PACKET;
+int poison = 1;             //poisoned reverse
+txpatch__t *patches = NULL; //for the packet being built, dest is a link index
+int num_patches = 0;
+int patches_alloced = 0;
+
+void parse_node_config(char *nodefp);
+void parse_neighbor_config(char *neighborfp);
+void generate_topology(int count, int degree);
+int find_node(uint32_t id);
+int has_link(simnode__t *node, uint32_t peer);
+void add_link(uint32_t a, uint32_t b, uint32_t cost);
+void start_routers();
+void push_event(simevent__t *ev);
+simevent__t pop_event();
+void run(time_t max_seconds);
+time_t sim_now(router__t *r);
+void sim_set_timer(router__t *r, int timer, time_t when);
+void sim_send_full(router__t *r);
+void sim_send_changed(router__t *r, routeentry__t *routes, int count);
+void sim_put_route(simnode__t *node, ripwriter__t *w, simpacket__t **packet, uint32_t destination, uint32_t metric,
+                   uint32_t next_hop, const uint32_t *more_hops);
+void sim_poison(simnode__t *node, ripwriter__t *w, uint32_t next_hop);
+simpacket__t *sim_packet(size_t size);
+void sim_flush(simnode__t *node, ripwriter__t *w, simpacket__t **packet);
+void deliver(simevent__t *ev);
+int check_routes();
+void report(int verbose);
+
+const routeops__t sim_ops = {sim_now, sim_set_timer, sim_send_full, sim_send_changed, NULL};
+
+int main(int argc, char **argv)
+{
+    int opt, verbose = 0, generate = 0, degree = DEGREE;
+    time_t max_seconds = MAX_SECONDS;
+    unsigned seed = time(NULL);
+
+    while ((opt = getopt(argc, argv, "u:m:d:t:s:g:Pv")) != -1) {
+        switch (opt) {
+        case 'u':
+            update_interval = strtod(optarg, NULL) * 1000;
+            break;
+        case 'm':
+            packet_size = rip_packet_size(strtoul(optarg, NULL, 10));
+            break;
+        case 'd':
+            link_delay = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            max_seconds = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%d,%d", &generate, &degree) < 1 || generate < 2 || degree < 2) {
+                argc = 0;
+            }
+            break;
+        case 'P':
+            poison = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            argc = 0;  //force the usage message
+        }
+    }
+
+    if (argc - optind != ((generate)?(0):(2))) {
+        printf("Usage: %s [-u update_interval] [-m mtu] [-d delay_ms] [-t max_seconds] [-s seed] [-P] [-v] (<node.config> <neighbor.config> | -g nodes[,degree])\n\n", argv[0]);
+        exit(1);
+    }
+
+    srand(seed);
+    if (generate) {
+        generate_topology(generate, degree);
+    } else {
+        parse_node_config(argv[optind]);
+        parse_neighbor_config(argv[optind + 1]);
+    }
+
+    start_routers();
+    run(max_seconds);
+    report(verbose);
+
+    for (int i = 0; i < num_nodes; i++) {
+        router_free(&nodes[i].router);
+        free(nodes[i].links);
+    }
+    free(nodes);
+    topo_free(&ids);
+    free(events);
+    free(patches);
+}
+
+void parse_node_config(char *nodefp)
+{
+    struct sockaddr_in addr;
+    uint32_t nick;
+    config__t c;
+
+    if (config_open(&c, nodefp) < 0) {
+        printf("  parse_node_config(): open(%s) ERROR: %s\n\n", nodefp, strerror(errno));
+        exit(2);
+    }
+    //there are at most as many nodes as lines
+    int lines = config_lines(&c);
+    if ((nodes = calloc(lines, sizeof(simnode__t))) == NULL) {
+        err_sys("  parse_node_config(): ERROR allocating memory!\n\n");
+    }
+    topo_init(&ids, lines);
+
+    while (config_node(&c, &nick, &addr)) {
+        node__t *id;
+
+        if ((id = topo_insert(&ids, nick)) == NULL) {
+            config_error(&c, "node %u is listed more than once", nick);
+            continue;
+        }
+        //nothing is removed from ids, so its indexes match nodes[]
+        simnode__t *node = &nodes[num_nodes++];
+        node->id = nick;
+        node->addr = addr;
+    }
+    if (config_close(&c) > 0) exit(2);
+}
+
+void parse_neighbor_config(char *neighborfp)
+{
+    uint32_t from, to, dist;
+    int a, b;
+    config__t c;
+
+    if (config_open(&c, neighborfp) < 0) {
+        printf("  parse_neighbor_config(): open(%s) ERROR: %s\n\n", neighborfp, strerror(errno));
+        exit(3);
+    }
+
+    while (config_link(&c, &from, &to, &dist)) {
+        if ((a = find_node(from)) < 0 || (b = find_node(to)) < 0) {
+            config_error(&c, "node %u isn't in node.config", a < 0 ? from : to);
+            continue;
+        }
+        if (a == b) {
+            config_error(&c, "node %u is linked to itself", from);
+            continue;
+        }
+        if (dist == 0) {
+            config_error(&c, "cost must be at least 1");
+            continue;
+        }
+        if (dist >= MAX_DISTANCE) {
+            config_warn(&c, "cost %u >= %d is unreachable, skipping the link", dist, MAX_DISTANCE);
+            continue;
+        }
+        if (!has_link(&nodes[a], b)) {
+            add_link(a, b, dist);
+        }
+    }
+    if (config_close(&c) > 0) exit(3);
+}
+
+// A ring, so the network is connected, plus random chords.  Node i has
+// id i + 1 and address 10.0.0.0 + i + 1, port 520.
+void generate_topology(int count, int degree)
+{
+    if ((nodes = calloc(count, sizeof(simnode__t))) == NULL) {
+        err_sys("  generate_topology(): ERROR allocating memory!\n\n");
+    }
+    num_nodes = count;
+
+    for (int i = 0; i < count; i++) {
+        nodes[i].id = i + 1;
+        nodes[i].addr.sin_family = AF_INET;
+        nodes[i].addr.sin_addr.s_addr = htonl(0x0a000000 + i + 1);
+        nodes[i].addr.sin_port = htons(520);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!has_link(&nodes[i], (i + 1) % count)) {
+            add_link(i, (i + 1) % count, 1);
+        }
+    }
+
+    //every chord adds two to the total degree
+    long chords = (long) count * (degree - 2) / 2;
+    for (long c = 0; c < chords; c++) {
+        int a = rand() % count, b = rand() % count;
+        if (a != b && !has_link(&nodes[a], b)) {
+            add_link(a, b, 1);
+        }
+    }
+}
+
+// Returns the index of the node with this id, or -1.
+int find_node(uint32_t id)
+{
+    node__t *node = topo_find(&ids, id);
+    return node ? (int) node->index : -1;
+}
+
+int has_link(simnode__t *node, uint32_t peer)
+{
+    for (int i = 0; i < node->num_links; i++) {
+        if (node->links[i].peer == peer) return 1;
+    }
+    return 0;
+}
+
+void add_link(uint32_t a, uint32_t b, uint32_t cost)
+{
+    uint32_t ends[2] = {a, b};
+
+    for (int i = 0; i < 2; i++) {
+        simnode__t *node = &nodes[ends[i]];
+        if (node->num_links >= node->alloced) {
+            node->alloced = (node->alloced == 0)?(4):(node->alloced * 2);
+            if ((node->links = realloc(node->links, node->alloced * sizeof(simlink__t))) == NULL) {
+                err_sys("  add_link(): ERROR allocating memory!\n\n");
+            }
+        }
+        node->links[node->num_links].peer = ends[1 - i];
+        node->links[node->num_links].cost = cost;
+        node->num_links++;
+    }
+}
+
+// Each router starts out knowing itself and its neighbors, the way myrip
+// does after reading its config, and learns everyone else from updates.
+void start_routers()
+{
+    for (int i = 0; i < num_nodes; i++) {
+        simnode__t *sim = &nodes[i];
+        router__t *r = &sim->router;
+
+        router_init(r, sim->num_links + 1, &sim_ops, sim);
+        r->update_interval = update_interval;
+        r->dead_route = 4 * update_interval;
+        r->garbage_route = 3 * update_interval;
+        r->table_limit = num_nodes;
+
+        r->self = topo_insert(&r->topo, sim->id);
+        r->self->distance = 0;
+        r->self->next_hop = sim->id;
+        r->self->destaddr = sim->addr;
+        topo_index_addr(&r->topo, r->self);
+
+        for (int j = 0; j < sim->num_links; j++) {
+            simnode__t *peer = &nodes[sim->links[j].peer];
+            node__t *node = topo_insert(&r->topo, peer->id);
+            node->distance = sim->links[j].cost;
+            node->cost = sim->links[j].cost;
+            node->neighbor = 1;
+            node->destaddr = peer->addr;
+            topo_index_addr(&r->topo, node);
+        }
+
+        router_start(r);
+    }
+}
+
+static int event_before(simevent__t *a, simevent__t *b)
+{
+    return (a->when < b->when) || (a->when == b->when && a->seq < b->seq);
+}
+
+void push_event(simevent__t *ev)
+{
+    if (num_events >= events_alloced) {
+        events_alloced = (events_alloced == 0)?(1024):(events_alloced * 2);
+        if ((events = realloc(events, events_alloced * sizeof(simevent__t))) == NULL) {
+            err_sys("  push_event(): ERROR allocating memory!\n\n");
+        }
+    }
+
+    ev->seq = next_seq++;
+    int i = num_events++;
+    while (i > 0 && event_before(ev, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = *ev;
+}
+
+simevent__t pop_event()
+{
+    simevent__t top = events[0];
+    simevent__t last = events[--num_events];
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= num_events) break;
+        if (child + 1 < num_events && event_before(&events[child + 1], &events[child])) child++;
+        if (!event_before(&events[child], &last)) break;
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+// Handles events in time order until the routes have been quiet for
+// QUIET_INTERVALS update intervals, or max_seconds have gone by.
+void run(time_t max_seconds)
+{
+    time_t quiet = QUIET_INTERVALS * (update_interval + RANDOM_SPREAD);
+
+    while (num_events > 0) {
+        simevent__t ev = pop_event();
+        if (ev.when > (uint64_t) max_seconds * 1000) break;
+        if ((time_t) ev.when - last_change > quiet) break;
+        now_ms = ev.when;
+
+        router__t *r = &nodes[ev.node].router;
+        if (ev.type == SIM_TIMER) {
+            router_timer(r, ev.timer, now_ms);
+        } else {
+            deliver(&ev);
+        }
+
+        if (r->last_change > last_change) last_change = r->last_change;
+        r->stale = 0;
+    }
+
+    //drop the packets still in flight
+    while (num_events > 0) {
+        simevent__t ev = pop_event();
+        if (ev.type == SIM_DELIVER && --ev.packet->refs == 0) free(ev.packet);
+    }
+}
+
+time_t sim_now(router__t *r)
+{
+    return now_ms;
+}
+
+// Stale timer events are left in the heap, router_timer() ignores them.
+void sim_set_timer(router__t *r, int timer, time_t when)
+{
+    if (when == TIME_T_MAX) return;
+
+    simevent__t ev;
+    bzero(&ev, sizeof(ev));
+    ev.when = ((uint64_t) when < now_ms)?(now_ms):((uint64_t) when);
+    ev.type = SIM_TIMER;
+    ev.timer = timer;
+    ev.node = (simnode__t *) r->env - nodes;
+    push_event(&ev);
+}
+
+void sim_send_full(router__t *r)
+{
+    simnode__t *node = r->env;
+    simpacket__t *packet = NULL;
+    ripwriter__t w;
+
+    for (int i = 0; i < r->topo.used; i++) {
+        node__t *route = topo_node(&r->topo, i);
+        if (route->next_hop != 0 || route->garbage) {
+            sim_put_route(node, &w, &packet, route->destination, (route->next_hop != 0)?(route->distance):(MAX_DISTANCE),
+                          route->next_hop, route->more_hops);
+        }
+    }
+    sim_flush(node, &w, &packet);
+}
+
+void sim_send_changed(router__t *r, routeentry__t *routes, int count)
+{
+    simnode__t *node = r->env;
+    simpacket__t *packet = NULL;
+    ripwriter__t w;
+
+    for (int i = 0; i < count; i++) {
+        sim_put_route(node, &w, &packet, routes[i].destination, routes[i].metric, routes[i].next_hop, routes[i].more_hops);
+    }
+    sim_flush(node, &w, &packet);
+}
+
+// Same splitting and poisoning as myrip's queue_route(), into one packet
+// at a time.
+void sim_put_route(simnode__t *node, ripwriter__t *w, simpacket__t **packet, uint32_t destination, uint32_t metric,
+                   uint32_t next_hop, const uint32_t *more_hops)
+{
+    if (*packet == NULL || !rip_put_entry(w, destination, metric)) {
+        sim_flush(node, w, packet);
+        *packet = sim_packet(packet_size);
+        rip_writer_init(w, (*packet)->data, packet_size, RIP_RESPONSE);
+        rip_put_entry(w, destination, metric);
+    }
+    if (!poison || metric >= MAX_DISTANCE) return;
+
+    sim_poison(node, w, next_hop);
+    for (int i = 0; i < TOPO_PATHS - 1 && more_hops[i] != 0; i++) {
+        sim_poison(node, w, more_hops[i]);
+    }
+}
+
+// Makes the entry just written in w unreachable in next_hop's copy.
+void sim_poison(simnode__t *node, ripwriter__t *w, uint32_t next_hop)
+{
+    for (int i = 0; i < node->num_links; i++) {
+        if (nodes[node->links[i].peer].id != next_hop) continue;
+
+        if (num_patches >= patches_alloced) {
+            patches_alloced = (patches_alloced == 0)?(64):(patches_alloced * 2);
+            if ((patches = realloc(patches, patches_alloced * sizeof(txpatch__t))) == NULL) {
+                err_sys("  sim_poison(): ERROR allocating memory!\n\n");
+            }
+        }
+        patches[num_patches].offset = rip_last_metric(w);
+        patches[num_patches].dest = i;
+        patches[num_patches].value = htonl(MAX_DISTANCE);
+        num_patches++;
+        break;
+    }
+}
+
+simpacket__t *sim_packet(size_t size)
+{
+    simpacket__t *packet = malloc(sizeof(simpacket__t) + size);
+    if (!packet) {
+        err_sys("  sim_packet(): ERROR allocating memory!\n\n");
+    }
+    packet->refs = 0;
+    return packet;
+}
+
+// Puts the packet on every link, arriving link_delay from now.  Links
+// with patches get their own patched copy.
+void sim_flush(simnode__t *node, ripwriter__t *w, simpacket__t **packet)
+{
+    if (*packet == NULL) return;
+
+    (*packet)->len = w->len;
+    for (int i = 0; i < node->num_links; i++) {
+        simpacket__t *copy = *packet;
+        simevent__t ev;
+
+        for (int j = 0; j < num_patches; j++) {
+            if (patches[j].dest != (uint32_t) i) continue;
+            if (copy == *packet) {
+                copy = sim_packet(w->len);
+                copy->len = w->len;
+                memcpy(copy->data, (*packet)->data, w->len);
+            }
+            memcpy(copy->data + patches[j].offset, &patches[j].value, sizeof(uint32_t));
+        }
+        copy->refs++;
+
+        bzero(&ev, sizeof(ev));
+        ev.when = now_ms + link_delay;
+        ev.type = SIM_DELIVER;
+        ev.node = node->links[i].peer;
+        ev.from = node - nodes;
+        ev.packet = copy;
+        push_event(&ev);
+
+        node->messages++;
+        node->bytes += w->len;
+    }
+    if ((*packet)->refs == 0) free(*packet);
+    *packet = NULL;
+    num_patches = 0;
+}
+
+void deliver(simevent__t *ev)
+{
+    router__t *r = &nodes[ev->node].router;
+    ripreader__t rd;
+    node__t *sender;
+
+    if ((sender = is_neighbor(r, nodes[ev->from].addr)) != NULL
+            && rip_reader_init(&rd, ev->packet->data, ev->packet->len) >= 0) {
+        update_routes(r, &rd, sender);
+    }
+    if (--ev->packet->refs == 0) free(ev->packet);
+}
+
+// Compares every router's table with the real shortest paths (capped at
+// MAX_DISTANCE, like RIP).  Costs are small, so Dial's algorithm: one
+// bucket per distance.  Returns how many routes are wrong or missing.
+int check_routes()
+{
+    uint32_t *dist = malloc(num_nodes * sizeof(uint32_t));
+    uint32_t *buckets = malloc((MAX_DISTANCE + 1) * num_nodes * sizeof(uint32_t));
+    int counts[MAX_DISTANCE + 1];
+    int wrong = 0;
+
+    if (!dist || !buckets) {
+        err_sys("  check_routes(): ERROR allocating memory!\n\n");
+    }
+
+    for (int src = 0; src < num_nodes; src++) {
+        for (int i = 0; i < num_nodes; i++) dist[i] = MAX_DISTANCE;
+        bzero(counts, sizeof(counts));
+        dist[src] = 0;
+        buckets[counts[0]++] = src;
+
+        for (uint32_t d = 0; d < MAX_DISTANCE; d++) {
+            for (int k = 0; k < counts[d]; k++) {
+                simnode__t *node = &nodes[buckets[d * num_nodes + k]];
+                if (dist[node - nodes] != d) continue;  //found a shorter way meanwhile
+                for (int j = 0; j < node->num_links; j++) {
+                    uint32_t peer = node->links[j].peer;
+                    uint32_t nd = d + node->links[j].cost;
+                    if (nd < dist[peer]) {
+                        dist[peer] = nd;
+                        buckets[nd * num_nodes + counts[nd]++] = peer;
+                    }
+                }
+            }
+        }
+
+        router__t *r = &nodes[src].router;
+        for (int i = 0; i < num_nodes; i++) {
+            node__t *route = get_node(r, nodes[i].id);
+            uint32_t have = (route && route->next_hop != 0)?(route->distance):(MAX_DISTANCE);
+            if (have != dist[i]) wrong++;
+        }
+    }
+
+    free(dist);
+    free(buckets);
+    return wrong;
+}
+
+void report(int verbose)
+{
+    long messages = 0, bytes = 0, max_messages = 0, max_bytes = 0, links = 0, multipath = 0;
+
+    for (int i = 0; i < num_nodes; i++) {
+        topo__t *topo = &nodes[i].router.topo;
+        for (int j = 0; j < topo->used; j++) {
+            if (topo_node(topo, j)->more_hops[0] != 0) multipath++;
+        }
+        messages += nodes[i].messages;
+        bytes += nodes[i].bytes;
+        links += nodes[i].num_links;
+        if (nodes[i].messages > max_messages) max_messages = nodes[i].messages;
+        if (nodes[i].bytes > max_bytes) max_bytes = nodes[i].bytes;
+    }
+
+    if (verbose) {
+        printf("node  links  messages  bytes\n");
+        for (int i = 0; i < num_nodes; i++) {
+            printf("%u  %d  %ld  %ld\n", nodes[i].id, nodes[i].num_links, nodes[i].messages, nodes[i].bytes);
+        }
+        printf("\n");
+    }
+
+    printf("nodes:             %d\n", num_nodes);
+    printf("links:             %ld\n", links / 2);
+    printf("simulated:         %.3f s\n", now_ms / 1000.0);
+    printf("converged at:      %.3f s\n", last_change / 1000.0);
+    printf("messages:          %ld (%.1f per node, max %ld)\n", messages, (double) messages / num_nodes, max_messages);
+    printf("bytes:             %ld (%.1f per node, max %ld)\n", bytes, (double) bytes / num_nodes, max_bytes);
+    printf("multipath routes:  %ld\n", multipath);
+    printf("wrong routes:      %d of %ld\n", check_routes(), (long) num_nodes * num_nodes);
+}
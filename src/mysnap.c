@@ -0,0 +1,141 @@
+/*
+ * mysnap.c
+ *
+ * Read-only copies of the routing table for other threads.  One thread
+ * owns the table and is the only one that changes it; now and then it
+ * copies the table into a snapshot and publishes it by swapping one
+ * pointer.  Readers never take a lock and never see a half-done change,
+ * and a snapshot is only freed once no reader can still be looking at
+ * it (epoch-based reclamation, a simple form of RCU).
+ *
+ * The writer bumps the epoch every time it replaces a snapshot and tags
+ * the old one with the new epoch.  A reader records the epoch it started
+ * in before it loads the pointer, so any reader that could have loaded
+ * the old snapshot recorded an older epoch than its tag.
+ */
+
+#include "mysnap.h"
+
+void snap_init(snapdomain__t *d)
+{
+    bzero(d, sizeof(*d));
+    d->epoch = 1;
+}
+
+// Returns an id for one reader thread.  Call it before the threads start.
+int snap_add_reader(snapdomain__t *d)
+{
+    if (d->num_readers >= SNAP_MAX_READERS) {
+        err_quit("  snap_add_reader(): ERROR more than %d readers\n", SNAP_MAX_READERS);
+    }
+    return d->num_readers++;
+}
+
+// Copies every node in topo.  Only the thread that owns topo may call this.
+snapshot__t *snap_build(topo__t *topo, node__t *self)
+{
+    //widest elements first so every array stays aligned
+    size_t n = topo->count;
+    size_t size = sizeof(snapshot__t) + n * (sizeof(time_t) + sizeof(struct sockaddr_in)
+        + sizeof(uint32_t[TOPO_PATHS]) + 2 * sizeof(uint32_t) + sizeof(uint8_t));
+    snapshot__t *snap = malloc(size);
+    if (!snap) {
+        err_sys("  snap_build(): ERROR allocating memory!\n\n");
+    }
+
+    snap->last_updated = (time_t *) (snap + 1);
+    snap->destaddr = (struct sockaddr_in *) (snap->last_updated + n);
+    snap->hops = (uint32_t (*)[TOPO_PATHS]) (snap->destaddr + n);
+    snap->destination = (uint32_t *) (snap->hops + n);
+    snap->metric = snap->destination + n;
+    snap->flags = (uint8_t *) (snap->metric + n);
+
+    snap->version = 0;
+    snap->retired = 0;
+    snap->next_retired = NULL;
+    snap->self = (self)?(self->destination):(0);
+    snap->count = 0;
+
+    for (int i = 0; i < topo->used; i++) {
+        node__t *node = topo_node(topo, i);
+        if (node->destination == 0) continue;
+
+        int r = snap->count++;
+        snap->destination[r] = node->destination;
+        snap->metric[r] = (node->next_hop)?(node->distance):(RIP_INFINITY);
+        snap->hops[r][0] = node->next_hop;
+        memcpy(&snap->hops[r][1], node->more_hops, sizeof(node->more_hops));
+        snap->last_updated[r] = node->last_updated;
+        snap->destaddr[r] = node->destaddr;
+        snap->flags[r] = ((node->neighbor)?(SNAP_NEIGHBOR):(0))
+            | ((node->garbage)?(SNAP_GARBAGE):(0))
+            | ((node->restored)?(SNAP_RESTORED):(0))
+            | ((node->next_hop || node->garbage)?(SNAP_ADVERTISED):(0));
+    }
+
+    return snap;
+}
+
+// Frees retired snapshots that every reader has moved past.
+static void snap_reclaim(snapdomain__t *d)
+{
+    uint64_t oldest = UINT64_MAX;
+
+    for (int i = 0; i < d->num_readers; i++) {
+        uint64_t epoch = __atomic_load_n(&d->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+
+    //the list is newest first, so everything after the first one we can
+    //free can be freed too
+    for (snapshot__t **p = &d->retired; *p; p = &(*p)->next_retired) {
+        if ((*p)->retired <= oldest) {
+            snapshot__t *snap = *p;
+            *p = NULL;
+            while (snap) {
+                snapshot__t *next = snap->next_retired;
+                free(snap);
+                snap = next;
+            }
+            break;
+        }
+    }
+}
+
+// Makes snap the current snapshot and takes ownership of it.  Writer only.
+void snap_publish(snapdomain__t *d, snapshot__t *snap)
+{
+    snap->version = ++d->version;
+
+    snapshot__t *old = __atomic_exchange_n(&d->current, snap, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->retired = __atomic_add_fetch(&d->epoch, 1, __ATOMIC_SEQ_CST);
+        old->next_retired = d->retired;
+        d->retired = old;
+    }
+
+    snap_reclaim(d);
+}
+
+// Returns the current snapshot, which stays valid until snap_exit().
+// May be NULL if nothing was published yet.
+snapshot__t *snap_enter(snapdomain__t *d, int reader)
+{
+    uint64_t epoch = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&d->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&d->current, __ATOMIC_SEQ_CST);
+}
+
+void snap_exit(snapdomain__t *d, int reader)
+{
+    __atomic_store_n(&d->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Only once the reader threads are gone.
+void snap_free(snapdomain__t *d)
+{
+    d->num_readers = 0;
+    snap_reclaim(d);
+    free(d->current);
+    bzero(d, sizeof(*d));
+}
@@ -0,0 +1,67 @@
+/*
+ * mysnap.h
+ *
+ * Read-only copies of the routing table for other threads.  One thread
+ * owns the table and is the only one that changes it; now and then it
+ * copies the table into a snapshot and publishes it by swapping one
+ * pointer.  Readers never take a lock and never see a half-done change,
+ * and a snapshot is only freed once no reader can still be looking at
+ * it (epoch-based reclamation, a simple form of RCU).
+ */
+
+#ifndef MYSNAP_H
+#define MYSNAP_H
+
+#include <stdint.h>
+#include "mytopo.h"
+#include "mypacket.h"
+
+#define SNAP_MAX_READERS 8
+
+//bits of snapshot__t.flags
+#define SNAP_NEIGHBOR 0x01
+#define SNAP_GARBAGE 0x02
+#define SNAP_RESTORED 0x04
+#define SNAP_ADVERTISED 0x08  //goes into full dumps: reachable or garbage
+
+// The routes are kept as one array per field rather than one array of
+// structs, so a full dump walks just the destinations and metrics it
+// encodes, in two dense arrays.  Route i is element i of every array, in
+// table order, and all of them live in the same allocation as the header.
+typedef struct snapshot {
+    uint64_t version;         //1 for the first snapshot published, and so on
+    uint64_t retired;         //epoch it was replaced in
+    struct snapshot *next_retired;
+    uint32_t self;            //this node's destination
+    int count;
+    uint32_t *destination;
+    uint32_t *metric;         //distance, RIP_INFINITY if unreachable or garbage
+    uint32_t (*hops)[TOPO_PATHS];  //next hop then equal-cost ones, 0 = unused
+    time_t *last_updated;
+    struct sockaddr_in *destaddr;
+    uint8_t *flags;
+} snapshot__t;
+
+typedef struct {
+    uint64_t epoch;           //0 = not reading
+    char pad[56];             //one cache line per reader
+} snapreader__t;
+
+typedef struct {
+    snapshot__t *current;
+    uint64_t epoch;
+    snapreader__t readers[SNAP_MAX_READERS];
+    int num_readers;
+    snapshot__t *retired;     //replaced but maybe still read, writer only
+    uint64_t version;         //writer only
+} snapdomain__t;
+
+void snap_init(snapdomain__t *d);
+int snap_add_reader(snapdomain__t *d);
+snapshot__t *snap_build(topo__t *topo, node__t *self);
+void snap_publish(snapdomain__t *d, snapshot__t *snap);
+snapshot__t *snap_enter(snapdomain__t *d, int reader);
+void snap_exit(snapdomain__t *d, int reader);
+void snap_free(snapdomain__t *d);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * mystate.c
+ *
+ * The state file: the routes of a running myrip, saved now and then so
+ * a restarted one can advertise and install them within milliseconds
+ * instead of relearning them over several update intervals.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "mystate.h"
+
+// Writes the valid routes in snap to path.  Returns 0, or -1 with the
+// old file left alone.
+int state_save(const char *path, snapshot__t *snap)
+{
+    char tmp[PATH_MAX];
+    size_t size = sizeof(stateheader__t) + (size_t) snap->count * sizeof(staterecord__t);
+    stateheader__t *header;
+    staterecord__t *records;
+    uint32_t count = 0;
+    void *map;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        printf("  state_save(): open(%s) error: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0 || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        printf("  state_save(): %s: %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    header = map;
+    records = (staterecord__t *) (header + 1);
+    for (int i = 0; i < snap->count; i++) {
+        staterecord__t *record = &records[count];
+
+        if (snap->hops[i][0] == 0 || snap->destination[i] == snap->self) continue;
+        record->destination = snap->destination[i];
+        record->distance = snap->metric[i];
+        memcpy(record->hops, snap->hops[i], sizeof(record->hops));
+        count++;
+    }
+
+    memcpy(header->magic, STATE_MAGIC, sizeof(header->magic));
+    header->version = STATE_VERSION;
+    header->paths = TOPO_PATHS;
+    header->self = snap->self;
+    header->count = count;
+    header->snapshot = snap->version;
+    header->saved = time(NULL);
+    munmap(map, size);
+
+    //unreachable routes weren't written, give their space back
+    size = sizeof(stateheader__t) + (size_t) count * sizeof(staterecord__t);
+    if (ftruncate(fd, size) < 0 || close(fd) < 0 || rename(tmp, path) < 0) {
+        printf("  state_save(): %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Restores the routes in path into r, which has been started.  Returns
+// how many were restored, or -1 if there is no usable file.
+int state_load(const char *path, router__t *r)
+{
+    const stateheader__t *header;
+    const staterecord__t *records;
+    struct stat st;
+    int fd, restored = 0;
+    void *map;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno != ENOENT) printf("  state_load(): open(%s) error: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(stateheader__t)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        printf("  state_load(): %s is too short or unreadable, ignoring it\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    header = map;
+    records = (const staterecord__t *) (header + 1);
+    if (memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) != 0 || header->version != STATE_VERSION
+            || header->paths != TOPO_PATHS
+            || (size_t) st.st_size != sizeof(stateheader__t) + (size_t) header->count * sizeof(staterecord__t)) {
+        printf("  state_load(): %s isn't a version %d state file, ignoring it\n", path, STATE_VERSION);
+        restored = -1;
+    } else if (header->self != r->self->destination) {
+        printf("  state_load(): %s was written by node %u, ignoring it\n", path, header->self);
+        restored = -1;
+    } else if (r->update_interval == 0) {
+        //no expiry (-u 0): nothing would ever take back a restored route nobody confirms
+        printf("  state_load(): route expiry is off (-u 0), not restoring %s\n", path);
+        restored = -1;
+    } else if ((time(NULL) - header->saved) * 1000 > r->dead_route) {
+        //the routes would have timed out by now had we kept running
+        printf("  state_load(): %s is %lld seconds old, ignoring it\n", path, (long long) (time(NULL) - header->saved));
+        restored = -1;
+    } else {
+        for (uint32_t i = 0; i < header->count; i++) {
+            restored += router_restore(r, records[i].destination, records[i].distance, records[i].hops);
+        }
+    }
+
+    munmap(map, st.st_size);
+    return restored;
+}
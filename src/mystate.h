@@ -0,0 +1,45 @@
+/*
+ * mystate.h
+ *
+ * The state file: the routes of a running myrip, saved now and then so
+ * a restarted one can advertise and install them within milliseconds
+ * instead of relearning them over several update intervals.  It is a
+ * header and then one fixed-size record per valid route, written
+ * through a memory mapping to a temporary file that is renamed over the
+ * old one, so a reader only ever sees a whole file.
+ *
+ * A file is only loaded if it has this version and layout, was written
+ * by the same node, and isn't older than the route timeout.  With -u 0
+ * routes never time out, so a restored one nobody confirms would stay
+ * forever; nothing is loaded then.
+ */
+
+#ifndef MYSTATE_H
+#define MYSTATE_H
+
+#include "mysnap.h"
+#include "myroute.h"
+
+#define STATE_MAGIC "MYRIPST"  //8 bytes with the '\0'
+#define STATE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t paths;             //TOPO_PATHS of the writer, the record size depends on it
+    uint32_t self;              //the node that wrote it
+    uint32_t count;             //records that follow
+    uint64_t snapshot;          //version of the snapshot it was written from
+    int64_t saved;              //wall clock, seconds since the epoch
+} stateheader__t;
+
+typedef struct {
+    uint32_t destination;
+    uint32_t distance;
+    uint32_t hops[TOPO_PATHS];  //next hops, 0 = unused
+} staterecord__t;
+
+int state_save(const char *path, snapshot__t *snap);
+int state_load(const char *path, router__t *r);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * mystatus.c
+ *
+ * Prints the routing table from its own thread, working from snapshots
+ * (mysnap.h) so printing never holds up the thread that owns the table.
+ * A changing table is printed at most once per interval, and a request
+ * (SIGUSR1 in myrip) prints it right away.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "mystatus.h"
+#include "mytimer.h"
+#include "mypacket.h"
+
+#define MAX_DISTANCE_WIDTH 2    //RIP_INFINITY is 16
+#define TIME_WIDTH 2
+
+static int digits(uint32_t n)
+{
+    int width = 1;
+    while (n >= 10) {
+        n /= 10;
+        width++;
+    }
+    return width;
+}
+
+static void bump(int efd)
+{
+    uint64_t one = 1;
+
+    //only fails if the counter would overflow, and then it's readable anyway
+    if (write(efd, &one, sizeof(one)) < 0) return;
+}
+
+// Takes a reader id from snaps, so call it before any thread starts.
+void status_init(status__t *st, snapdomain__t *snaps, int interval, int format)
+{
+    st->snaps = snaps;
+    st->reader = snap_add_reader(snaps);
+    st->interval = interval;
+    st->format = format;
+    st->out = stdout;
+    st->next = NULL;
+    st->printed = 0;
+    st->changed_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    st->request_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (st->changed_efd < 0 || st->request_efd < 0) {
+        err_sys("  status_init(): eventfd() ERROR");
+    }
+}
+
+// Has first's thread print st's table too, so only first's thread is
+// started.  st shares first's eventfds and settings from then on.
+void status_join(status__t *st, status__t *first)
+{
+    close(st->changed_efd);
+    close(st->request_efd);
+    st->changed_efd = first->changed_efd;
+    st->request_efd = first->request_efd;
+    st->interval = first->interval;
+    st->format = first->format;
+    st->next = first->next;
+    first->next = st;
+}
+
+// Call this after publishing a snapshot.
+void status_changed(status__t *st)
+{
+    bump(st->changed_efd);
+}
+
+// Asks for a printout now.  Safe to call from a signal handler.
+void status_request(status__t *st)
+{
+    bump(st->request_efd);
+}
+
+static void render_table(status__t *st, snapshot__t *snap, time_t now)
+{
+    //the same for every row, so only work them out once
+    int label_width = digits(snap->count);
+
+    fprintf(st->out, "------------------Topography--------------------\n");
+    fprintf(st->out, "Node            | Dist     Time   IP\n");
+    fprintf(st->out, "------------------------------------------------\n");
+
+    for (int i = 0; i < snap->count; i++) {
+        char ip[INET_ADDRSTRLEN];
+
+        fprintf(st->out, "%p  %*u%c | %*d@%*u    %*ld     %s:%u\n",
+            (void *) &snap->destination[i],
+            label_width, snap->destination[i],
+            (snap->destination[i] == snap->self)?('*'):((snap->flags[i] & SNAP_NEIGHBOR)?('-'):(' ')),
+            MAX_DISTANCE_WIDTH, snap->metric[i],
+            label_width, snap->hops[i][0],
+            TIME_WIDTH, (long) ((now - snap->last_updated[i]) / 1000),
+            inet_ntop(AF_INET, &snap->destaddr[i].sin_addr, ip, sizeof(ip)),
+            ntohs(snap->destaddr[i].sin_port));
+    }
+    fprintf(st->out, "------------------------------------------------\n\n\n\n\n");
+}
+
+static void render_compact(status__t *st, snapshot__t *snap, time_t now)
+{
+    fprintf(st->out, "# version %llu routes %d self %u\n",
+            (unsigned long long) snap->version, snap->count, snap->self);
+
+    for (int i = 0; i < snap->count; i++) {
+        char ip[INET_ADDRSTRLEN], flags[6], *f = flags;
+
+        if (snap->destination[i] == snap->self) *f++ = 'S';
+        if (snap->flags[i] & SNAP_NEIGHBOR) *f++ = 'N';
+        if (snap->flags[i] & SNAP_GARBAGE) *f++ = 'G';
+        if (snap->hops[i][1] != 0) *f++ = 'M';
+        if (snap->flags[i] & SNAP_RESTORED) *f++ = 'R';
+        if (f == flags) *f++ = '-';
+        *f = '\0';
+
+        fprintf(st->out, "%u %u %u %ld %s %s:%u\n",
+            snap->destination[i],
+            snap->metric[i],
+            snap->hops[i][0],
+            (long) ((now - snap->last_updated[i]) / 1000),
+            flags,
+            inet_ntop(AF_INET, &snap->destaddr[i].sin_addr, ip, sizeof(ip)),
+            ntohs(snap->destaddr[i].sin_port));
+    }
+}
+
+// Prints snap in st's format, in one piece even if other threads print.
+void status_render(status__t *st, snapshot__t *snap)
+{
+    if (!snap) return;
+
+    flockfile(st->out);
+    if (st->format == STATUS_COMPACT) {
+        render_compact(st, snap, timer_now());
+    } else {
+        render_table(st, snap, timer_now());
+    }
+    fflush(st->out);
+    funlockfile(st->out);
+}
+
+// The thread body, arg is the first status__t.  Prints each table's
+// first snapshot as soon as there is one.
+void *status_thread(void *arg)
+{
+    status__t *st = arg;
+    struct pollfd fds[2] = {{st->changed_efd, POLLIN, 0}, {st->request_efd, POLLIN, 0}};
+    uint64_t count;
+    time_t last_print = 0;
+    int changed = 1;
+
+    for (;;) {
+        int timeout = -1, now_please = 0;
+
+        if (changed && st->interval > 0) {
+            time_t wait = last_print + st->interval * 1000 - timer_now();
+            timeout = (wait > 0)?(wait):(0);
+        }
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) continue;
+            err_sys("  status_thread(): poll() ERROR");
+        }
+        if (read(st->changed_efd, &count, sizeof(count)) > 0) changed = 1;
+        if (read(st->request_efd, &count, sizeof(count)) > 0) now_please = 1;
+
+        if (!now_please && (!changed || st->interval == 0 || timer_now() < last_print + st->interval * 1000)) {
+            continue;
+        }
+
+        for (status__t *s = st; s; s = s->next) {
+            snapshot__t *snap = snap_enter(s->snaps, s->reader);
+            if (snap && (now_please || snap->version != s->printed)) {
+                status_render(s, snap);
+                s->printed = snap->version;
+                last_print = timer_now();
+            }
+            snap_exit(s->snaps, s->reader);
+        }
+        changed = 0;
+    }
+    return NULL;
+}
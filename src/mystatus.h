@@ -0,0 +1,49 @@
+/*
+ * mystatus.h
+ *
+ * Prints the routing table from its own thread, working from snapshots
+ * (mysnap.h) so printing never holds up the thread that owns the table.
+ * A changing table is printed at most once per interval, and a request
+ * (SIGUSR1 in myrip) prints it right away.  One thread can print the
+ * tables of several routers, see status_join().
+ *
+ * The compact format is meant for scripts.  Each printout is a header
+ * line and then one line per route:
+ *
+ *   # version <n> routes <count> self <id>
+ *   <dest> <metric> <next hop, 0 = none> <age in seconds> <flags> <ip>:<port>
+ *
+ * flags is any of S (this node), N (neighbor), G (being garbage
+ * collected), M (more equal-cost next hops than the one shown) and R
+ * (restored from the state file, not confirmed yet), or - for none of
+ * them.
+ */
+
+#ifndef MYSTATUS_H
+#define MYSTATUS_H
+
+#include "mysnap.h"
+
+#define STATUS_TABLE 0      //the human-readable table
+#define STATUS_COMPACT 1
+
+typedef struct status {
+    snapdomain__t *snaps;
+    int reader;             //snapshot reader id
+    int interval;           //seconds between printouts, 0 = only on request
+    int format;
+    FILE *out;
+    int changed_efd;        //eventfd, a new snapshot was published
+    int request_efd;        //eventfd, print now
+    struct status *next;    //more tables printed by the same thread
+    uint64_t printed;       //version of the snapshot last printed, status thread
+} status__t;
+
+void status_init(status__t *st, snapdomain__t *snaps, int interval, int format);
+void status_join(status__t *st, status__t *first);
+void status_changed(status__t *st);
+void status_request(status__t *st);
+void status_render(status__t *st, snapshot__t *snap);
+void *status_thread(void *arg);
+
+#endif
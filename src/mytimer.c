@@ -1,113 +1,256 @@
 /*
  * mytimer.c
  *
- * This library lets you use absolute timers with select().
+ * This library gives you one-time timers backed by a
+ * timerfd on CLOCK_MONOTONIC, so they have nanosecond resolution and
+ * don't move when the wall clock is set.  Hand each timer to
+ * ev_add_timer() (myevent.h) and it fires from the event loop.
  *
- * See timertest.c for an example of its use.
+ * It also has a hashed timer wheel for keeping thousands of deadlines
+ * (one per route) behind a single timer.
  */
 
 #include <time.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
 #include "mytimer.h"
 #include "myunp.h"
+#include "mymetrics.h"
 
-// Call this function to start a one-time timer.
-// After this timer fires, it won't restart.
-void timer_start(mytimer_t *timer,
-                 int delay_in_seconds,
-                 void (*callback)(time_t))
+static struct timespec ts_now()
 {
-    //printf("timer_start(): %d\n", delay_in_seconds);
-    
-    timer->alarm_time   = time(NULL) + delay_in_seconds;
-    timer->period       = 0;    // special value means non-periodic timer
-    timer->callback     = callback;
-    
-    //printf("  alarm=%ld, per=%d, call=%p\n", (long)timer->alarm_time, timer->period, timer->callback);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+static struct timespec ts_add(struct timespec a, long sec, long nsec)
+{
+    a.tv_sec  += sec + (a.tv_nsec + nsec) / 1000000000L;
+    a.tv_nsec  = (a.tv_nsec + nsec) % 1000000000L;
+    return a;
+}
+
+// Program the timerfd to go off once at timer->alarm_time (absolute).
+static void timer_arm(mytimer_t *timer)
+{
+    struct itimerspec its;
+
+    bzero(&its, sizeof(its));
+    its.it_value = timer->alarm_time;
+
+    //an all-zero it_value would disarm the timer instead of firing it now
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(timer_fd(timer), TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        err_sys("  timer_arm(): timerfd_settime() ERROR");
+    }
+}
+
+static time_t ts_msec(struct timespec ts)
+{
+    return (time_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Milliseconds on the monotonic clock.  Use this instead of time(NULL)
+// for anything that measures an interval.  It is a vDSO call, not a
+// system call, but a loop can still cache it, see ev_now().
+time_t timer_now()
+{
+    return ts_msec(ts_now());
+}
+
+// Returns the timer's timerfd, creating it the first time.
+int timer_fd(mytimer_t *timer)
+{
+    if (timer->fd < 0) {
+        if ((timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            err_sys("  timer_fd(): timerfd_create() ERROR");
+        }
+    }
+    return timer->fd;
 }
 
-// Call this function to start a periodic timer.
-// After it fires, it will restart automatically.
-void timer_start_periodic(mytimer_t *timer,
-                          int delay_in_seconds,
-                          void (*callback)(time_t))
+// Call this function to start a one-time timer that fires
+// delay_in_msec milliseconds from now.  After it fires, it won't restart.
+void timer_start_msec(mytimer_t *timer,
+                      long delay_in_msec,
+                      void (*callback)(time_t, void *))
 {
-    timer->alarm_time   = time(NULL) + delay_in_seconds;
-    timer->period       = delay_in_seconds;
+    timer->alarm_time   = ts_add(ts_now(), delay_in_msec / 1000, (delay_in_msec % 1000) * 1000000L);
     timer->callback     = callback;
+    timer_arm(timer);
+}
+
+// Same as timer_start_msec(), for an absolute time from timer_now().
+void timer_start_at(mytimer_t *timer,
+                    time_t when,
+                    void (*callback)(time_t, void *))
+{
+    timer->alarm_time.tv_sec  = when / 1000;
+    timer->alarm_time.tv_nsec = (when % 1000) * 1000000L;
+    timer->callback           = callback;
+    timer_arm(timer);
 }
 
 // Call this function to clear a running timer.
 // After calling this function, the timer won't fire.
 void timer_clear(mytimer_t *timer)
 {
-    timer->alarm_time = TIME_T_MAX;
+    struct itimerspec its;
+
+    timer->alarm_time.tv_sec  = TIME_T_MAX;
+    timer->alarm_time.tv_nsec = 0;
+    if (timer->fd >= 0) {
+        bzero(&its, sizeof(its));
+        timerfd_settime(timer->fd, 0, &its, NULL);
+    }
+}
+
+int timer_pending(mytimer_t *timer)
+{
+    return timer->alarm_time.tv_sec != TIME_T_MAX;
 }
 
-// Call this function after select() to check each timer.
-// If it's time for the timer to fire, it will call the callback function.
-// If the timer is periodic, it will restart automatically.
-void timer_check(mytimer_t *timer)
+// The event loop calls this when the timerfd is readable.  now is the
+// loop's time for this wakeup, which the callback gets so that it and
+// everything else handled in the same wakeup agree on the time.
+void timer_fire(mytimer_t *timer, time_t now)
 {
-    time_t now = time(NULL);
+    uint64_t expirations;
+    struct timespec fired;
 
-    if (now >= timer->alarm_time)
-    {
-        // Clear or restart the timer.
-        if (timer->period == 0)
-        {
-            // clear the one-time timer
-            timer->alarm_time = TIME_T_MAX;
-        }
-        else
-        {
-            // restart the periodic timer
-            timer->alarm_time += timer->period;
+    //nothing to read means the timer was cleared or restarted meanwhile
+    if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    fired = ts_now();
+    metric_observe(HIST_TIMER_LATE, (uint64_t) (fired.tv_sec - timer->alarm_time.tv_sec) * 1000000000
+                                    + (fired.tv_nsec - timer->alarm_time.tv_nsec));
+
+    // clear the one-time timer
+    timer->alarm_time.tv_sec  = TIME_T_MAX;
+    timer->alarm_time.tv_nsec = 0;
+
+    // Call the callback function.
+    if (timer->callback != NULL) timer->callback(now, timer->arg);
+}
+
+static uint32_t *wheel_slot(mywheel_t *wheel, time_t when)
+{
+    return &wheel->slots[(when / WHEEL_TICK) % WHEEL_SLOTS];
+}
+
+void wheel_init(mywheel_t *wheel, int num_ids, time_t now)
+{
+    bzero(wheel, sizeof(*wheel));
+    wheel->now = now;
+    wheel_reserve(wheel, num_ids);
+}
+
+// Make room for ids 0..num_ids-1.  New ids start out unscheduled.
+void wheel_reserve(mywheel_t *wheel, int num_ids)
+{
+    if (num_ids <= wheel->alloced) return;
+
+    wheel->next = realloc(wheel->next, num_ids * sizeof(uint32_t));
+    wheel->prev = realloc(wheel->prev, num_ids * sizeof(uint32_t));
+    wheel->deadline = realloc(wheel->deadline, num_ids * sizeof(time_t));
+    if (!wheel->next || !wheel->prev || !wheel->deadline) {
+        err_sys("  wheel_reserve(): ERROR allocating memory!\n\n");
+    }
+    for (int i = wheel->alloced; i < num_ids; i++) {
+        wheel->next[i] = wheel->prev[i] = 0;
+        wheel->deadline[i] = TIME_T_MAX;
+    }
+    wheel->alloced = num_ids;
+}
+
+void wheel_cancel(mywheel_t *wheel, uint32_t id)
+{
+    if (wheel->deadline[id] == TIME_T_MAX) return;
+
+    if (wheel->prev[id]) {
+        wheel->next[wheel->prev[id] - 1] = wheel->next[id];
+    } else {
+        *wheel_slot(wheel, wheel->deadline[id]) = wheel->next[id];
+    }
+    if (wheel->next[id]) {
+        wheel->prev[wheel->next[id] - 1] = wheel->prev[id];
+    }
+    wheel->next[id] = wheel->prev[id] = 0;
+    wheel->deadline[id] = TIME_T_MAX;
+}
+
+// (Re)schedule id for deadline, replacing any earlier deadline.  O(1).
+void wheel_schedule(mywheel_t *wheel, uint32_t id, time_t deadline)
+{
+    wheel_cancel(wheel, id);
+
+    //deadlines that are already past fire on the next wheel_advance()
+    if (deadline <= wheel->now) deadline = wheel->now + 1;
+
+    uint32_t *slot = wheel_slot(wheel, deadline);
+    wheel->deadline[id] = deadline;
+    wheel->prev[id] = 0;
+    wheel->next[id] = *slot;
+    if (*slot) {
+        wheel->prev[*slot - 1] = id + 1;
+    }
+    *slot = id + 1;
+}
+
+// The end of the earliest tick that has something in its slot, by when
+// everything due in it has expired, or TIME_T_MAX if the wheel is empty.
+// Entries more than WHEEL_SLOTS ticks out may make this early, in which
+// case wheel_advance() just finds nothing to do.
+time_t wheel_next(mywheel_t *wheel)
+{
+    time_t tick = wheel->now / WHEEL_TICK;
+
+    for (time_t t = tick; t < tick + WHEEL_SLOTS; t++) {
+        if (wheel->slots[t % WHEEL_SLOTS]) {
+            time_t end = (t + 1) * WHEEL_TICK - 1;
+            return (end > wheel->now)?(end):(wheel->now + 1);
         }
-        
-        // Call the callback function.
-        if (timer->callback != NULL) timer->callback(now);
     }
+    return TIME_T_MAX;
 }
 
-// Call this function before calling tv_timer().
-void tv_init(struct timeval *tv)
-{
-    //printf("\ntv_init: before: sec=%ld\n", tv->tv_sec);
-    
-    tv->tv_usec = 0;
-    tv->tv_sec  = LONG_MAX;
-    
-    //printf("\ntv_init: after: sec=%ld\n", tv->tv_sec);
-}
-
-// Call this function for each timer before calling select().
-// After it's been called for all timers, tv will have a timeout
-// for the earliest timer. Then you can pass &tv to select().
-void tv_timer(struct timeval *tv, mytimer_t *timer)
-{
-    
-    //printf("\ntv_timer: before:\n  tv->sec=%ld\n  tv->usec=%d\n  timer->alarm_time=%ld\n", 
-    //        tv->tv_sec, tv->tv_usec, (long)timer->alarm_time);
-    
-    // How many seconds until the timer's alarm goes off?
-    time_t num_seconds = timer->alarm_time - time(NULL);
-
-    // trigger past timer immediately
-    if (num_seconds < 0) num_seconds = 0;
-    
-    //printf("  num_seconds=%ld\n", (long)num_seconds);
-    
-    
-    // select() has an undocumented maximum allowed value for tv_sec.
-    if (num_seconds > 100000000) num_seconds = 100000000;
-
-    // use the earliest timer
-    if (num_seconds < tv->tv_sec)
-    {
-        tv->tv_sec = (long) num_seconds;
+// Calls expire(id, now, arg) for every id whose deadline is at or before
+// now, after unscheduling it, so expire() may schedule it again.  Only the
+// slots for the ticks since the last call are looked at, starting with
+// the last call's own, which may have had entries due later in it.
+int wheel_advance(mywheel_t *wheel, time_t now, void (*expire)(uint32_t, time_t, void *), void *arg)
+{
+    int expired = 0;
+    time_t first = wheel->now / WHEEL_TICK, last = now / WHEEL_TICK;
+
+    //a long sleep has to visit each slot once, not once per tick
+    if (last - first >= WHEEL_SLOTS) last = first + WHEEL_SLOTS - 1;
+
+    for (time_t t = first; t <= last; t++) {
+        uint32_t next;
+        for (uint32_t id1 = wheel->slots[t % WHEEL_SLOTS]; id1; id1 = next) {
+            next = wheel->next[id1 - 1];
+            if (wheel->deadline[id1 - 1] <= now) {
+                wheel_cancel(wheel, id1 - 1);
+                expire(id1 - 1, now, arg);
+                expired++;
+            }
+        }
     }
-    
-    //printf("\ntv_timer: after:\n  tv->sec=%ld\n  tv->usec=%d\n  timer->alarm_time=%ld\n", 
-    //        tv->tv_sec, tv->tv_usec, (long)timer->alarm_time);
+    if (now > wheel->now) wheel->now = now;
+
+    return expired;
+}
+
+void wheel_free(mywheel_t *wheel)
+{
+    free(wheel->next);
+    free(wheel->prev);
+    free(wheel->deadline);
+    bzero(wheel, sizeof(*wheel));
 }
@@ -1,11 +1,21 @@
 /*
  * mytimer.h
  *
- * This library lets you use absolute timers with select().
+ * This library gives you one-time timers backed by a
+ * timerfd on CLOCK_MONOTONIC, so they have nanosecond resolution and
+ * don't move when the wall clock is set.  Hand each timer to
+ * ev_add_timer() (myevent.h) and it fires from the event loop, calling
+ * back with the time and the argument it was added with.  Times passed
+ * around as time_t are milliseconds on the monotonic clock, see
+ * timer_now().
  *
- * See timertest.c for an example of its use.
+ * It also has a hashed timer wheel for keeping thousands of deadlines
+ * (one per route) behind a single timer.
  */
 
+#ifndef MYTIMER_H
+#define MYTIMER_H
+
 #include <time.h>
 #include <limits.h>
 #include "myunp.h"
@@ -14,16 +24,43 @@
 
 typedef struct
 {
-    time_t  alarm_time;
-    long    period;
-    void    (*callback)(time_t);
+    struct timespec alarm_time;   //CLOCK_MONOTONIC, tv_sec = TIME_T_MAX when idle
+    void    (*callback)(time_t, void *);
+    void    *arg;                 //passed to callback, see ev_add_timer()
+    int     fd;                   //timerfd, created on first use
 } mytimer_t;
 
-#define TIMER_INIT {TIME_T_MAX, 0, NULL}
+#define TIMER_INIT {{TIME_T_MAX, 0}, NULL, NULL, -1}
 
-void timer_start(mytimer_t *timer, int delay_in_seconds, void (*)(time_t));
-void timer_start_periodic(mytimer_t *timer, int delay_in_seconds, void (*)(time_t));
+time_t timer_now();
+int timer_fd(mytimer_t *timer);
+void timer_start_msec(mytimer_t *timer, long delay_in_msec, void (*)(time_t, void *));
+void timer_start_at(mytimer_t *timer, time_t when, void (*)(time_t, void *));
 void timer_clear(mytimer_t *timer);
-void timer_check(mytimer_t *timer);
-void tv_init(struct timeval *tv);
-void tv_timer(struct timeval *tv, mytimer_t *timer);
+int timer_pending(mytimer_t *timer);
+void timer_fire(mytimer_t *timer, time_t now);
+
+#define WHEEL_TICK 10       //milliseconds per slot, deadlines fire up to this late
+#define WHEEL_SLOTS 4096    //a little over 40 seconds
+
+// Entries are small integer ids (0..alloced) chosen by the caller, linked
+// through per-id arrays so the wheel never allocates while running.
+typedef struct
+{
+    uint32_t *next;         //id + 1, 0 = end of list
+    uint32_t *prev;         //id + 1, 0 = head of its slot
+    time_t  *deadline;      //TIME_T_MAX = not scheduled
+    int     alloced;
+    uint32_t slots[WHEEL_SLOTS];
+    time_t  now;            //when wheel_advance() last ran
+} mywheel_t;
+
+void wheel_init(mywheel_t *wheel, int num_ids, time_t now);
+void wheel_reserve(mywheel_t *wheel, int num_ids);
+void wheel_schedule(mywheel_t *wheel, uint32_t id, time_t deadline);
+void wheel_cancel(mywheel_t *wheel, uint32_t id);
+time_t wheel_next(mywheel_t *wheel);
+int wheel_advance(mywheel_t *wheel, time_t now, void (*expire)(uint32_t, time_t, void *), void *arg);
+void wheel_free(mywheel_t *wheel);
+
+#endif
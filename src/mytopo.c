@@ -0,0 +1,282 @@
+/*
+ * mytopo.c
+ *
+ * Routing table for myrip.  Nodes live in fixed-size slabs that never
+ * move, so the table can grow at runtime without fragmenting the heap
+ * or invalidating node pointers, and freed nodes are reused.  They are
+ * indexed twice with open addressing: once by destination id and once
+ * by (sin_addr, sin_port), so lookups on the packet path are O(1).
+ */
+
+#include "mytopo.h"
+
+// MurmurHash3's finalizer: every bit of the key moves every bit of the
+// hash, so masking off the low bits for a slot is fine.  A bare multiply
+// only carries bits upwards, and the low bits of s_addr are the first
+// octets of the address, the same for a whole subnet.
+static uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_dest(uint32_t destination)
+{
+    return fmix32(destination);
+}
+
+static uint32_t hash_addr(struct sockaddr_in addr)
+{
+    return fmix32(addr.sin_addr.s_addr ^ ((uint32_t) addr.sin_port << 16 | addr.sin_port));
+}
+
+static uint32_t hash_dest_of(topo__t *topo, uint32_t index)
+{
+    return hash_dest(topo_node(topo, index)->destination);
+}
+
+static uint32_t hash_addr_of(topo__t *topo, uint32_t index)
+{
+    return hash_addr(topo_node(topo, index)->destaddr);
+}
+
+static int same_addr(struct sockaddr_in a, struct sockaddr_in b)
+{
+    return (a.sin_addr.s_addr == b.sin_addr.s_addr) && (a.sin_port == b.sin_port);
+}
+
+//only nodes from node.config have an address worth indexing
+static int has_addr(node__t *node)
+{
+    return node->destaddr.sin_port != 0;
+}
+
+static void slot_put(uint32_t *slots, uint32_t mask, uint32_t hash, uint32_t index)
+{
+    uint32_t i = hash & mask;
+    while (slots[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = index + 1;
+}
+
+// Linear probing can't just empty a slot, that would cut off the entries
+// probed past it.  Shift later entries back instead (Knuth's Algorithm R).
+static void slot_del(topo__t *topo, uint32_t *slots, uint32_t hash, uint32_t index,
+                     uint32_t (*hash_of)(topo__t *, uint32_t))
+{
+    uint32_t mask = topo->mask;
+    uint32_t i = hash & mask;
+
+    while (slots[i] != index + 1) {
+        if (slots[i] == 0) return;
+        i = (i + 1) & mask;
+    }
+
+    for (uint32_t j = i; ; ) {
+        slots[i] = 0;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (slots[j] == 0) return;
+            //leave it if its home slot is cyclically in (i, j]
+            uint32_t home = hash_of(topo, slots[j] - 1) & mask;
+            if ((i <= j)?((i < home) && (home <= j)):((i < home) || (home <= j))) continue;
+            break;
+        }
+        slots[i] = slots[j];
+        i = j;
+    }
+}
+
+// Rebuild both indexes with num_slots slots each
+static void topo_rehash(topo__t *topo, uint32_t num_slots)
+{
+    free(topo->by_dest);
+    free(topo->by_addr);
+    topo->by_dest = calloc(num_slots, sizeof(uint32_t));
+    topo->by_addr = calloc(num_slots, sizeof(uint32_t));
+    if (!topo->by_dest || !topo->by_addr) {
+        err_sys("  topo_rehash(): ERROR allocating memory!\n\n");
+    }
+    topo->mask = num_slots - 1;
+
+    for (int i = 0; i < topo->used; i++) {
+        node__t *node = topo_node(topo, i);
+        if (node->destination == 0) continue;
+        slot_put(topo->by_dest, topo->mask, hash_dest(node->destination), i);
+        if (has_addr(node)) {
+            slot_put(topo->by_addr, topo->mask, hash_addr(node->destaddr), i);
+        }
+    }
+}
+
+static void topo_add_slab(topo__t *topo)
+{
+    topo->num_slabs++;
+    topo->alloced = topo->num_slabs * TOPO_SLAB;
+    if ((topo->slabs = realloc(topo->slabs, topo->num_slabs * sizeof(node__t *))) == NULL
+            || (topo->slabs[topo->num_slabs - 1] = calloc(TOPO_SLAB, sizeof(node__t))) == NULL
+            || (topo->dirty = realloc(topo->dirty, topo->alloced * sizeof(uint32_t))) == NULL) {
+        err_sys("  topo_add_slab(): ERROR allocating memory!\n\n");
+    }
+}
+
+// num_nodes is only a hint for sizing the indexes.
+void topo_init(topo__t *topo, int num_nodes)
+{
+    uint32_t num_slots = 8;
+    while (num_slots < 2 * (uint32_t) num_nodes) {
+        num_slots *= 2;
+    }
+
+    bzero(topo, sizeof(*topo));
+    topo_rehash(topo, num_slots);
+}
+
+// Sizes the indexes for num_nodes up front, so a big table loaded from
+// the config isn't rehashed over and over on the way there.
+void topo_reserve(topo__t *topo, int num_nodes)
+{
+    uint32_t num_slots = topo->mask + 1;
+    while (num_slots < 2 * (uint32_t) num_nodes) {
+        num_slots *= 2;
+    }
+
+    if (num_slots > topo->mask + 1) topo_rehash(topo, num_slots);
+}
+
+// Adds a zeroed node for destination and returns it, or NULL if the
+// destination is already in the table (or is the reserved id 0).
+// Nodes never move, so earlier pointers stay valid.
+node__t *topo_insert(topo__t *topo, uint32_t destination)
+{
+    uint32_t index;
+    node__t *node;
+    int dirty = 0;
+
+    if (destination == 0 || topo_find(topo, destination) != NULL) {
+        return NULL;
+    }
+
+    //keep the indexes at most half full
+    if (2 * (uint32_t) (topo->count + 1) > topo->mask + 1) {
+        topo_rehash(topo, 2 * (topo->mask + 1));
+    }
+
+    if (topo->free_head) {
+        index = topo->free_head - 1;
+        node = topo_node(topo, index);
+        topo->free_head = node->next_hop;
+        //a freed slot may still be listed in the dirty set, see topo_remove()
+        dirty = node->dirty;
+    } else {
+        if (topo->used >= topo->alloced) {
+            topo_add_slab(topo);
+        }
+        index = topo->used++;
+        node = topo_node(topo, index);
+    }
+
+    bzero(node, sizeof(*node));
+    node->destination = destination;
+    node->index = index;
+    node->dirty = dirty;
+    topo->count++;
+    slot_put(topo->by_dest, topo->mask, hash_dest(destination), index);
+
+    return node;
+}
+
+// Frees node's slot for reuse.  If it is in the dirty set it stays there;
+// whoever walks the set skips free slots (destination 0).
+void topo_remove(topo__t *topo, node__t *node)
+{
+    uint32_t index = node->index;
+    int dirty = node->dirty;
+
+    slot_del(topo, topo->by_dest, hash_dest(node->destination), index, hash_dest_of);
+    if (has_addr(node)) {
+        slot_del(topo, topo->by_addr, hash_addr(node->destaddr), index, hash_addr_of);
+    }
+
+    bzero(node, sizeof(*node));
+    node->index = index;
+    node->dirty = dirty;
+    node->next_hop = topo->free_head;
+    topo->free_head = index + 1;
+    topo->count--;
+}
+
+// Call this once node->destaddr is filled in so topo_find_addr() can see it.
+void topo_index_addr(topo__t *topo, node__t *node)
+{
+    if (has_addr(node)) {
+        slot_put(topo->by_addr, topo->mask, hash_addr(node->destaddr), node->index);
+    }
+}
+
+// Call this before changing node->destaddr, and topo_index_addr() after.
+void topo_unindex_addr(topo__t *topo, node__t *node)
+{
+    if (has_addr(node)) {
+        slot_del(topo, topo->by_addr, hash_addr(node->destaddr), node->index, hash_addr_of);
+    }
+}
+
+node__t *topo_find(topo__t *topo, uint32_t destination)
+{
+    if (!topo->by_dest) return NULL;
+
+    for (uint32_t i = hash_dest(destination) & topo->mask; topo->by_dest[i]; i = (i + 1) & topo->mask) {
+        node__t *node = topo_node(topo, topo->by_dest[i] - 1);
+        if (node->destination == destination) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+node__t *topo_find_addr(topo__t *topo, struct sockaddr_in addr)
+{
+    if (!topo->by_addr) return NULL;
+
+    for (uint32_t i = hash_addr(addr) & topo->mask; topo->by_addr[i]; i = (i + 1) & topo->mask) {
+        node__t *node = topo_node(topo, topo->by_addr[i] - 1);
+        if (same_addr(node->destaddr, addr)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Each slot is in the dirty set at most once, so it never outgrows the table.
+void topo_mark_dirty(topo__t *topo, node__t *node)
+{
+    if (node->dirty) return;
+    node->dirty = 1;
+    topo->dirty[topo->num_dirty++] = node->index;
+}
+
+void topo_clear_dirty(topo__t *topo)
+{
+    for (int i = 0; i < topo->num_dirty; i++) {
+        topo_node(topo, topo->dirty[i])->dirty = 0;
+    }
+    topo->num_dirty = 0;
+}
+
+void topo_free(topo__t *topo)
+{
+    for (int i = 0; i < topo->num_slabs; i++) {
+        free(topo->slabs[i]);
+    }
+    free(topo->slabs);
+    free(topo->by_dest);
+    free(topo->by_addr);
+    free(topo->dirty);
+    bzero(topo, sizeof(*topo));
+}
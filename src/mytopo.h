@@ -0,0 +1,70 @@
+/*
+ * mytopo.h
+ *
+ * Routing table for myrip.  Nodes live in fixed-size slabs that never
+ * move, so the table can grow at runtime without fragmenting the heap
+ * or invalidating node pointers, and freed nodes are reused.  They are
+ * indexed twice with open addressing: once by destination id and once
+ * by (sin_addr, sin_port), so lookups on the packet path are O(1).
+ */
+
+#ifndef MYTOPO_H
+#define MYTOPO_H
+
+#include "myunp.h"
+
+#define TOPO_SLAB_SHIFT 10
+#define TOPO_SLAB (1 << TOPO_SLAB_SHIFT)     //nodes per slab
+#define TOPO_PATHS 4                         //equal-cost next hops kept per destination
+
+typedef struct {
+    uint32_t distance;
+    uint32_t next_hop;
+    uint32_t more_hops[TOPO_PATHS - 1];  //others at the same distance, packed, 0 = unused
+    struct sockaddr_in destaddr;
+    uint32_t destination;   //0 = free slot
+    time_t last_updated;    //when next_hop last confirmed the route, in milliseconds
+    time_t more_updated[TOPO_PATHS - 1];
+    int neighbor;
+    uint32_t cost;       //link cost from neighbor.config, if neighbor
+    int dirty;           //in topo->dirty, waiting for a triggered update
+    int garbage;         //expired, still advertised as unreachable
+    int learned;         //not in node.config, removed once garbage collected
+    int restored;        //from the state file of an earlier run, not confirmed yet
+    uint32_t index;      //position in the table, stable for the node's life
+} node__t;
+
+typedef struct {
+    node__t **slabs;
+    int num_slabs;
+    int count;           //nodes in use
+    int used;            //slots ever handed out, iterate 0..used
+    int alloced;         //num_slabs * TOPO_SLAB
+    uint32_t free_head;  //index + 1 of the first free slot, chained through next_hop
+    uint32_t *by_dest;   //slot = node index + 1, 0 = empty
+    uint32_t *by_addr;
+    uint32_t mask;       //number of slots - 1, always a power of two
+    uint32_t *dirty;     //indexes of nodes changed since the last update
+    int num_dirty;
+} topo__t;
+
+#define TOPO_INIT {NULL, 0, 0, 0, 0, 0, NULL, NULL, 0, NULL, 0}
+
+static inline node__t *topo_node(topo__t *topo, uint32_t index)
+{
+    return &topo->slabs[index >> TOPO_SLAB_SHIFT][index & (TOPO_SLAB - 1)];
+}
+
+void topo_init(topo__t *topo, int num_nodes);
+void topo_reserve(topo__t *topo, int num_nodes);
+node__t *topo_insert(topo__t *topo, uint32_t destination);
+void topo_remove(topo__t *topo, node__t *node);
+void topo_index_addr(topo__t *topo, node__t *node);
+void topo_unindex_addr(topo__t *topo, node__t *node);
+node__t *topo_find(topo__t *topo, uint32_t destination);
+node__t *topo_find_addr(topo__t *topo, struct sockaddr_in addr);
+void topo_mark_dirty(topo__t *topo, node__t *node);
+void topo_clear_dirty(topo__t *topo);
+void topo_free(topo__t *topo);
+
+#endif
@@ -4,6 +4,9 @@
 *   Purpose:    Header for wrapper functions of myunp.c
 */
 
+#ifndef MYUNP_H
+#define MYUNP_H
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -41,3 +44,5 @@ int Read(int sockfd, char *buffer, int bufferlen);
 int Write(int sockfd, char *buffer, int bufferlen);
 int Sendto(int sockfd, const void *buf, size_t len, int flags, 
            const struct sockaddr *dest_addr, socklen_t addrlen);
+
+#endif